@@ -1,4 +1,9 @@
+#include <algorithm>
+#include <exception>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <sstream>
 
 #include <seqan3/alphabet/nucleotide/dna4.hpp>
 #include <seqan3/search/search.hpp>
@@ -9,7 +14,204 @@
 namespace mars
 {
 
-void BiDirectionalIndex::create(std::filesystem::path const & filepath)
+// The memory estimates are given per nucleotide of a shard. They follow the in-memory construction of an FM index
+// (sdsl::construct_im), which seqan3 runs for either direction of the bi-directional index.
+
+//! \brief The copies of the text during construction: the concatenated collection that seqan3 passes to the sdsl,
+//!        its copy in the in-memory file cache of the sdsl, and the copy that is loaded for suffix sorting.
+static constexpr size_t construction_text_bytes{3};
+
+//! \brief The suffix array, which divsufsort computes with 32-bit entries for texts below `large_text_length`.
+static constexpr size_t construction_sa_bytes{4};
+
+//! \brief The additional suffix array bytes for texts of at least `large_text_length`, which need 64-bit entries.
+static constexpr size_t large_construction_sa_bytes{4};
+
+//! \brief The length from which the suffix array is computed with 64-bit entries.
+static constexpr uint64_t large_text_length{uint64_t{1} << 31};
+
+//! \brief The BWT and the wavelet tree and SA samples built from it, which exist next to the full suffix array.
+static constexpr size_t construction_bwt_bytes{3};
+
+//! \brief The peak memory for building one half of the index, which is reached while sampling the suffix array.
+static constexpr size_t construction_bytes_per_base{construction_text_bytes + construction_sa_bytes +
+                                                    construction_bwt_bytes};
+
+//! \brief The size of a bi-directional index: per direction a wavelet tree over the BWT of about one byte, including
+//!        its rank support, and the samples of SA and inverse SA with 8 bytes each at every `sa_sampling_rate`-th
+//!        position.
+static constexpr size_t index_bytes_per_base{2 * (1 + (16 + sa_sampling_rate - 1) / sa_sampling_rate)};
+
+//! \brief The peak memory for transferring concurrently built halves into the index: the serialized halves, including
+//!        the slack of the growing buffer of up to the same size, and the deserialized index exist at the same time.
+static constexpr size_t transfer_bytes_per_base{3 * index_bytes_per_base};
+
+// private helper function for build_shards
+uint64_t construction_bytes(uint64_t length)
+{
+    return length * (construction_bytes_per_base + (length < large_text_length ? 0u : large_construction_sa_bytes));
+}
+
+// private helper function for build_shards
+uint64_t max_construction_length(uint64_t available)
+{
+    uint64_t const max_length = available / construction_bytes_per_base;
+    if (max_length < large_text_length)
+        return max_length;
+    return std::max(large_text_length - 1u, available / (construction_bytes_per_base + large_construction_sa_bytes));
+}
+
+// private helper function for build_shards
+void build_index(IndexShard & shard, PackedGenome const & genome, unsigned int threads)
+{
+    size_t const last_seq = shard.first_seq + shard.num_seq;
+    if (threads < 2u)
+    {
+        auto texts = genome.sequences(shard.first_seq, last_seq);
+        shard.index = Index{texts};
+        return;
+    }
+
+    // The forward and reverse halves of the index are independent and can be built concurrently.
+    // The bi-directional index cannot adopt them, so they are transferred through their serialized form.
+    // Each half is serialized and released as soon as it is built, which bounds the peak memory of the transfer
+    // (see transfer_bytes_per_base).
+    std::stringstream buffer{};
+    {
+        std::future<ReverseIndex> rev_future = std::async(std::launch::async, [&genome, &shard, last_seq] ()
+        {
+            auto texts = genome.sequences(shard.first_seq, last_seq);
+            return ReverseIndex{texts};
+        });
+
+        // The archive of a bi-directional index consists of both halves in this order.
+        cereal::BinaryOutputArchive oarchive{buffer};
+        {
+            auto texts = genome.sequences(shard.first_seq, last_seq);
+            ForwardIndex const fwd_index{texts};
+            oarchive(fwd_index);
+        }
+        oarchive(rev_future.get());
+    }
+    cereal::BinaryInputArchive iarchive{buffer};
+    iarchive(shard.index);
+}
+
+// private helper function for build_shards
+std::vector<IndexShard> partition_genome(PackedGenome const & genome, size_t num_shards, size_t max_length)
+{
+    num_shards = std::max(num_shards, size_t{1});
+    std::vector<IndexShard> shards{};
+    shards.emplace_back();
+    size_t part{0};
+    uint64_t start{0};
+    uint64_t length{0};
+    for (size_t seq = 0; seq < genome.number_of_seq(); ++seq)
+    {
+        // Each sequence belongs to the part of the genome where its center is located.
+        uint64_t const seq_length = genome.seq_length(seq);
+        size_t const seq_part = (start + seq_length / 2) * num_shards / std::max(genome.total_length(), uint64_t{1});
+        start += seq_length;
+
+        // Open a new shard at a part boundary or if the sequence would exceed the memory limit.
+        if (shards.back().num_seq > 0 && (seq_part != part || length + seq_length > max_length))
+        {
+            shards.emplace_back();
+            shards.back().first_seq = seq;
+            length = 0;
+        }
+        part = seq_part;
+        ++shards.back().num_seq;
+        length += seq_length;
+    }
+    return shards;
+}
+
+// private helper function for BiDirectionalIndex
+std::vector<IndexShard> build_shards(PackedGenome const & genome,
+                                     NamePool const & names,
+                                     size_t first_seq,
+                                     size_t num_shards,
+                                     IndexOptions const & options)
+{
+    // Determine the maximum shard length that can be built within the memory budget.
+    size_t available = std::numeric_limits<size_t>::max();
+    size_t max_length = std::numeric_limits<size_t>::max();
+    if (options.max_memory > 0u)
+    {
+        // The packed genome stays in memory, while its shards are built one after another. The construction of a
+        // single sequence cannot be split and is not spilled to disk, so the budget must cover the longest one.
+        size_t const budget = options.max_memory << 20;
+        if (genome.memory_usage() >= budget)
+        {
+            std::ostringstream err_msg{};
+            err_msg << "The packed genome requires " << ((genome.memory_usage() >> 20) + 1) << " MiB, which exceeds "
+                    << "the memory limit of " << options.max_memory << " MiB for building the index.";
+            throw std::runtime_error(err_msg.str());
+        }
+        available = budget - genome.memory_usage();
+        max_length = max_construction_length(available);
+        for (size_t seq = 0; seq < genome.number_of_seq(); ++seq)
+        {
+            if (genome.seq_length(seq) > max_length)
+            {
+                uint64_t const required = genome.memory_usage() + construction_bytes(genome.seq_length(seq));
+                std::ostringstream err_msg{};
+                err_msg << "Building the index of sequence " << names[first_seq + seq] << " requires about "
+                        << ((required >> 20) + 1) << " MiB, which exceeds the memory limit of " << options.max_memory
+                        << " MiB. A sequence is never split into several shards and its index is built in memory.";
+                throw std::runtime_error(err_msg.str());
+            }
+        }
+    }
+    std::vector<IndexShard> shards = partition_genome(genome, num_shards, max_length);
+
+    // Build as many shards concurrently as the threads and the memory budget permit.
+    uint64_t largest{0};
+    for (IndexShard const & shard : shards)
+    {
+        uint64_t length{0};
+        for (size_t seq = shard.first_seq; seq < shard.first_seq + shard.num_seq; ++seq)
+            length += genome.seq_length(seq);
+        largest = std::max(largest, length);
+    }
+    size_t const required = std::max(construction_bytes(largest), uint64_t{1});
+    size_t const concurrent = std::clamp<size_t>(std::min<size_t>(options.threads, available / required),
+                                                 1u, shards.size());
+
+    // A single shard can still build its forward and reverse half concurrently, if the budget also covers the
+    // transfer of the halves into the index.
+    unsigned int const half_threads = concurrent == 1u && options.threads > 1u && available / 2 >= required &&
+                                      available / transfer_bytes_per_base >= largest
+                                    ? 2u : 1u;
+
+    if (verbose > 0)
+        std::cerr << "Create index with " << shards.size() << " shard(s) and SA sampling rate "
+                  << sa_sampling_rate << "... ";
+    std::exception_ptr error{};
+    #pragma omp parallel for num_threads(concurrent) schedule(dynamic)
+    for (size_t idx = 0; idx < shards.size(); ++idx)
+    {
+        try
+        {
+            build_index(shards[idx], genome, half_threads);
+        }
+        catch (...)
+        {
+            #pragma omp critical
+            error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+
+    // The shards are numbered relative to the genome, which starts at sequence first_seq of the index.
+    for (IndexShard & shard : shards)
+        shard.first_seq += first_seq;
+    return shards;
+}
+
+void BiDirectionalIndex::create(std::filesystem::path const & filepath, IndexOptions const & options)
 {
     if (filepath.empty())
         return;
@@ -17,10 +219,32 @@ void BiDirectionalIndex::create(std::filesystem::path const & filepath)
     std::filesystem::path indexpath = filepath;
     indexpath += ".marsindex";
 
-    // Check whether an index already exists.
-    if (read_index(index, names, indexpath))
+    // Check whether an up-to-date index already exists. Only the header is needed to decide this.
+    IndexHeader header{};
+    bool const has_header = read_index_header(header, indexpath);
+    if (has_header && (header.sa_sampling != sa_sampling_rate ||
+                       header.sa_strategy != static_cast<uint32_t>(sa_sampling_strategy)))
+    {
+        // The index is not overwritten, as it may be used by a build with another sampling.
+        std::ostringstream err_msg{};
+        auto const strategy_name = [] (uint32_t strategy)
+        {
+            return strategy == static_cast<uint32_t>(SaSampling::text_order) ? "text order" : "SA order";
+        };
+        err_msg << "The index file " << indexpath << " has the SA sampling rate " << header.sa_sampling << " ("
+                << strategy_name(header.sa_strategy) << "), but this program is configured with the sampling rate "
+                << sa_sampling_rate << " (" << strategy_name(static_cast<uint32_t>(sa_sampling_strategy))
+                << "). Remove the index file or use a build with matching sampling.";
+        throw std::runtime_error(err_msg.str());
+    }
+    if (has_header && index_is_outdated(header, filepath))
+    {
+        if (verbose > 0)
+            std::cerr << "The genome has changed since creating the index file " << indexpath << std::endl;
+        read_index_sources(sources, indexpath);
+    }
+    else if (read_index(shards, names, text, sources, indexpath, options.threads))
     {
-        cursors.emplace_back(index);
         if (verbose > 0)
             std::cerr << "Using existing index file: " << indexpath << std::endl;
         return;
@@ -29,18 +253,7 @@ void BiDirectionalIndex::create(std::filesystem::path const & filepath)
     // No index found: read genome and create an index.
     if (std::filesystem::exists(filepath))
     {
-        if (verbose > 0)
-            std::cerr << "Read genome from " << filepath << std::endl;
-        std::vector<seqan3::dna4_vector> seqs{};
-        read_genome(seqs, names, filepath);
-        // Generate the BiFM index.
-        if (verbose > 0)
-            std::cerr << "Create index... ";
-        index = Index{seqs};
-        cursors.emplace_back(index);
-        write_index(index, names, indexpath);
-        if (verbose > 0)
-            std::cerr << indexpath << std::endl;
+        build(filepath, options);
     }
     else
     {
@@ -54,65 +267,280 @@ void BiDirectionalIndex::create(std::filesystem::path const & filepath)
     }
 }
 
-bool BiDirectionalIndex::append_loop(std::pair<float, seqan3::rna4> item, bool left)
+void BiDirectionalIndex::build(std::filesystem::path const & filepath, IndexOptions const & options)
+{
+    // Read the genome and all appended files, which are merged into a single segment.
+    if (verbose > 0)
+        std::cerr << "Read genome from " << filepath << std::endl;
+    sources.genome = genome_file_info(filepath);
+    PackedGenome genome{};
+    names.clear();
+    read_genome(genome, names, filepath);
+    for (std::filesystem::path const & appendpath : sources.appended)
+    {
+        if (!std::filesystem::exists(appendpath))
+            throw seqan3::file_open_error("Could not find the appended sequence file: " + appendpath.string());
+        read_genome(genome, names, appendpath);
+    }
+    build(std::move(genome), filepath, options);
+}
+
+void BiDirectionalIndex::build(PackedGenome && genome,
+                               std::filesystem::path const & filepath,
+                               IndexOptions const & options)
 {
-    bool succ;
-    seqan3::bi_fm_index_cursor<Index> new_cur(cursors.back());
+    sources.genome.checksum = genome.checksum();
+    sources.genome.total_length = genome.total_length();
+    sources.compacted = sources.appended.size();
 
+    // Generate the BiFM index.
+    shards = build_shards(genome, names, 0u, options.shards, options);
+    std::filesystem::path indexpath = filepath;
+    indexpath += ".marsindex";
+    write_index(shards, names, genome, sources, indexpath, options);
+    text = options.store_text ? std::move(genome) : PackedGenome{};
+    if (verbose > 0)
+        std::cerr << indexpath << std::endl;
+}
+
+void BiDirectionalIndex::append(std::filesystem::path const & filepath,
+                                std::filesystem::path const & appendpath,
+                                IndexOptions const & options)
+{
+    create(filepath, options);
+    if (!std::filesystem::exists(appendpath))
+        throw seqan3::file_open_error("Could not find the sequence file to append: " + appendpath.string());
+
+    // A file that is already part of the index would duplicate its sequences.
+    std::filesystem::path const source = std::filesystem::weakly_canonical(appendpath);
+    bool const duplicate = source == std::filesystem::weakly_canonical(filepath) ||
+        std::ranges::any_of(sources.appended, [&source] (std::filesystem::path const & path)
+        {
+            return std::filesystem::weakly_canonical(path) == source;
+        });
+    if (duplicate)
+        throw std::runtime_error("The sequence file is already part of the index: " + appendpath.string());
+
+    // Only the new sequences are indexed, in a segment of its own.
+    if (verbose > 0)
+        std::cerr << "Append sequences from " << appendpath << std::endl;
+    size_t const first_seq = names.size();
+    PackedGenome genome{};
+    read_genome(genome, names, appendpath);
+    for (IndexShard & shard : build_shards(genome, names, first_seq, 1u, options))
+        shards.push_back(std::move(shard));
+    sources.appended.push_back(source);
+    sources.genome.total_length += genome.total_length();
+
+    // A stored text is extended by the new sequences, such that it keeps covering the whole index.
+    IndexOptions append_options{options};
+    append_options.store_text = has_text();
+    if (has_text())
+        for (size_t seq = 0; seq < genome.number_of_seq(); ++seq)
+            text.append(genome.sequence(seq));
+
+    std::filesystem::path indexpath = filepath;
+    indexpath += ".marsindex";
+    write_index(shards, names, text, sources, indexpath, append_options);
+    if (verbose > 0)
+        std::cerr << indexpath << std::endl;
+}
+
+void BiDirectionalIndex::compact(std::filesystem::path const & filepath, IndexOptions const & options)
+{
+    std::filesystem::path indexpath = filepath;
+    indexpath += ".marsindex";
+    if (!read_index_sources(sources, indexpath))
+        sources = IndexSources{};
+
+    // The stored text contains all sequences, such that the FASTA files need not be parsed again.
+    PackedGenome genome{};
+    IndexHeader header{};
+    if (read_index_header(header, indexpath) && !index_is_outdated(header, filepath) &&
+        read_index_text(names, genome, indexpath))
+    {
+        IndexOptions text_options{options};
+        text_options.store_text = true;
+        build(std::move(genome), filepath, text_options);
+        return;
+    }
+    if (!std::filesystem::exists(filepath))
+        throw seqan3::file_open_error("Could not find the genome file: " + filepath.string());
+    build(filepath, options);
+}
+
+std::vector<seqan3::dna4> BiDirectionalIndex::extract(size_t seq, size_t begin, size_t end) const
+{
+    std::vector<seqan3::dna4> result{};
+    if (seq >= text.number_of_seq())
+        return result;
+
+    uint64_t const length = text.seq_length(seq);
+    end = std::min<uint64_t>(end, length);
+    if (begin >= end)
+        return result;
+
+    result.reserve(end - begin);
+    uint64_t const offset = text.seq_start(seq);
+    for (uint64_t pos = offset + begin; pos < offset + end; ++pos)
+        result.push_back(text.at(pos));
+    return result;
+}
+
+void BiDirectionalSearch::push_loop(std::pair<float, seqan3::rna4> item, bool left)
+{
+    scores[depth + 1] = scores[depth] + item.first;
+    hashes[depth + 1] = hashes[depth];
+    powers[depth + 1] = powers[depth];
     if (left)
-        succ = new_cur.extend_left(item.second);
+        hash_left(item.second.to_rank());
     else
-        succ = new_cur.extend_right(item.second);
+        hash_right(item.second.to_rank());
+    ++depth;
+}
 
-    if (succ)
+void BiDirectionalSearch::compute_loop_children(uint8_t wanted, bool left)
+{
+    LoopChildren & result = children[depth];
+    result.valid = 0;
+    size_t remaining = cursors[depth].count();
+    for (uint8_t rank = 0; rank < 4 && remaining > 0; ++rank)
     {
-        cursors.push_back(new_cur);
-        scores.push_back(scores.back() + item.first);
+        if (((wanted >> rank) & 1u) == 0u)
+            continue;
+
+        seqan3::bi_fm_index_cursor<Index> & child = result.cursors[rank];
+        child = cursors[depth];
+        seqan3::rna4 const c = seqan3::rna4{}.assign_rank(rank);
+        if (left ? child.extend_left(c) : child.extend_right(c))
+        {
+            result.valid |= 1u << rank;
+            remaining -= child.count();
+        }
     }
-    return succ;
 }
 
-bool BiDirectionalIndex::append_stem(std::pair<float, bi_alphabet<seqan3::rna4>> stem_item)
+bool BiDirectionalSearch::append_child(std::pair<float, seqan3::rna4> item, bool left)
+{
+    uint8_t const rank = item.second.to_rank();
+    if (((children[depth].valid >> rank) & 1u) == 0u)
+        return false;
+
+    // The slot must be provided first, because it may reallocate the children.
+    ensure_capacity();
+    cursors[depth + 1] = children[depth].cursors[rank];
+    push_loop(item, left);
+    return true;
+}
+
+void BiDirectionalSearch::push_stem(std::pair<float, bi_alphabet<seqan3::rna4>> stem_item)
 {
-    seqan3::bi_fm_index_cursor<Index> new_cur(cursors.back());
     using seqan3::get;
-    seqan3::rna4 c = get<0>(stem_item.second);
-    bool succ = new_cur.extend_left(c);
-    if (succ)
-    {
-        c = get<1>(stem_item.second);
-        succ = new_cur.extend_right(c);
-    }
-    if (succ)
-    {
-        cursors.push_back(new_cur);
-        scores.push_back(scores.back() + stem_item.first);
-    }
-    return succ;
+    scores[depth + 1] = scores[depth] + stem_item.first;
+    hashes[depth + 1] = hashes[depth];
+    powers[depth + 1] = powers[depth];
+    hash_left(get<0>(stem_item.second).to_rank());
+    hash_right(get<1>(stem_item.second).to_rank());
+    ++depth;
 }
 
-void BiDirectionalIndex::backtrack()
+bool BiDirectionalSearch::append_stem_child(std::pair<float, bi_alphabet<seqan3::rna4>> stem_item)
 {
-    scores.pop_back();
-    cursors.pop_back();
+    using seqan3::get;
+    uint8_t const rank = get<0>(stem_item.second).to_rank();
+    if (((children[depth].valid >> rank) & 1u) == 0u)
+        return false;
+
+    // The slot must be provided first, because it may reallocate the children.
+    ensure_capacity();
+    seqan3::bi_fm_index_cursor<Index> & new_cur = cursors[depth + 1];
+    new_cur = children[depth].cursors[rank];
+    if (!new_cur.extend_right(get<1>(stem_item.second)))
+        return false;
+
+    push_stem(stem_item);
+    return true;
 }
 
-bool BiDirectionalIndex::xdrop() const
+bool BiDirectionalSearch::xdrop() const
 {
-    if (scores.size() < xdrop_dist)
+    if (depth + 1 < xdrop_dist)
         return false;
     else
-        return scores.back() < scores[scores.size() - xdrop_dist];
+        return scores[depth] < scores[depth + 1 - xdrop_dist];
+}
+
+void merge_leaves(LeafList & leaves)
+{
+    // An interval of a given query length belongs to exactly one query, such that equal intervals have equal hashes.
+    // Only leaves with equal keys need to be compared, which are almost always duplicates apart from hash collisions.
+    auto key = [] (SearchLeaf const & leaf)
+    {
+        return std::make_tuple(leaf.hash, leaf.cursor.count(), leaf.cursor.query_length());
+    };
+    std::sort(leaves.begin(), leaves.end(), [&key] (SearchLeaf const & a, SearchLeaf const & b)
+    {
+        return key(a) < key(b);
+    });
+
+    auto group_begin = leaves.begin();
+    auto out = leaves.begin();
+    for (auto leaf = leaves.begin(); leaf != leaves.end(); ++leaf)
+    {
+        if (key(*leaf) != key(*group_begin))
+            group_begin = out;
+
+        auto const equal = std::find_if(group_begin, out, [&leaf] (SearchLeaf const & merged)
+        {
+            return merged.cursor == leaf->cursor;
+        });
+        if (equal != out)
+        {
+            equal->score = std::max(equal->score, leaf->score);
+        }
+        else
+        {
+            if (out != leaf)
+                *out = std::move(*leaf);
+            ++out;
+        }
+    }
+    leaves.erase(out, leaves.end());
+}
+
+void merge_hits(std::vector<HitRecord> & hits)
+{
+    // The score occupies the lowest bits of the key, such that the last hit of a run of equal hits is the best.
+    auto same_hit = [] (HitRecord const & a, HitRecord const & b)
+    {
+        return a.key >> HitEncoding::score_bits == b.key >> HitEncoding::score_bits;
+    };
+    auto out = hits.begin();
+    for (auto hit = hits.begin(); hit != hits.end(); ++hit)
+        if (std::next(hit) == hits.end() || !same_hit(*hit, *std::next(hit)))
+            *out++ = *hit;
+    hits.erase(out, hits.end());
 }
 
-void BiDirectionalIndex::compute_hits(std::vector<std::vector<Hit>> & hits, StemloopMotif const & motif) const
+void locate_leaf(HitRecord * hits,
+                 SearchLeaf const & leaf,
+                 size_t first_seq,
+                 StemloopMotif const & motif,
+                 size_t max_offset,
+                 HitEncoding const & encoding,
+                 bool reverse)
 {
-    for (auto && [seq, pos] : cursors.back().locate())
+    // The shard reports local sequence numbers, which are mapped back to the global ones.
+    // On the reverse strand, the 5' end of the stem loop is the last matched position of the forward strand.
+    size_t const last = leaf.cursor.query_length() - 1;
+    for (auto && [seq, pos] : leaf.cursor.locate())
     {
-        assert(seq < hits.size());
-        hits[seq].emplace_back(pos + max_offset - motif.bounds.first,
-                               motif.uid,
-                               scores.back());
+        size_t const stemloop_pos = reverse ? encoding.mirror(pos + last) : pos;
+        *hits++ = HitRecord{encoding.encode(first_seq + seq,
+                                            stemloop_pos + max_offset - motif.bounds.first,
+                                            reverse,
+                                            motif.uid,
+                                            leaf.score)};
     }
 }
 
@@ -1,5 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -22,50 +30,237 @@ struct Hit
     uint8_t midx;
     float score;
 
+    Hit() = default;
     Hit(size_t pos, uint8_t midx, float score) : pos{pos}, midx{midx}, score{score} {}
 };
 
-//! \brief Provides a bi-directional search step-by-step with backtracking.
-class BiDirectionalIndex
+/*!
+ * \brief A compact hit, whose key encodes the sequence, the position, the motif and the score.
+ *
+ * \details
+ * Sorting the records by key orders them by sequence and position, and equal positions by motif and score.
+ * See HitEncoding for the layout.
+ */
+struct HitRecord
 {
-private:
-    //! \brief The index in which the search is performed.
-    Index index;
+    uint64_t key; //!< The sequence, position, motif and score of the hit.
+};
 
-    //! \brief The names of the sequences in the index.
-    std::vector<std::string> names;
+static_assert(sizeof(HitRecord) == 8, "A hit record must fit into 8 bytes.");
 
-    //! \brief The history of cursors (needed for backtracking).
-    std::vector<seqan3::bi_fm_index_cursor<Index>> cursors;
+/*!
+ * \brief Packs the sequence number, the strand, the position, the motif and the score of a hit into a 64-bit key.
+ *
+ * \details
+ * The sequence number occupies the upper bits, followed by one bit for the strand, the position, the motif and
+ * the score in the lowest 16 bits. Hence, the hits of the reverse strand are sorted behind those of the forward
+ * strand of the same sequence. The fields are just wide enough for the index and the motifs of a search.
+ * The score is stored as an unsigned fixed point number with a resolution of 1/64, where negative scores become 0
+ * and large scores saturate. This is lossless for the clustering, which treats negative scores as 0.
+ */
+class HitEncoding
+{
+private:
+    //! \brief The lowest bit of the sequence number; the strand bit and the position occupy the bits below.
+    unsigned int seq_shift;
 
-    //! \brief The history of scores;
-    std::vector<float> scores;
+    //! \brief The lowest bit of the position; the motif and the score occupy the bits below.
+    unsigned int pos_shift;
 
-    //! \brief The maximum possible motif offset.
-    size_t max_offset;
+    //! \brief The length of the longest sequence, which is the mirror axis of the reverse strand.
+    size_t max_length;
 
-    //! \brief The xdrop parameter.
-    unsigned char const xdrop_dist;
+    //! \brief The number of bits that are needed for the values below `limit`.
+    static unsigned int bit_width(uint64_t limit)
+    {
+        unsigned int bits = 0;
+        while (bits < 64 && limit > uint64_t{1} << bits)
+            ++bits;
+        return bits;
+    }
+
+    //! \brief The strand bit, i.e. the highest bit below the sequence number.
+    [[nodiscard]] uint64_t strand_bit() const
+    {
+        return uint64_t{1} << (seq_shift - 1);
+    }
 
 public:
+    //! \brief The number of bits of the score.
+    static constexpr unsigned int score_bits{16};
+
+    //! \brief The factor of the fixed point score, i.e. the inverse of its resolution.
+    static constexpr float score_factor{64.f};
+
     /*!
-     * \brief Constructor for a bi-directional search.
-     * \param xdrop The xdrop parameter.
+     * \brief Choose the layout for an index and a set of motifs.
+     * \param num_seq The number of sequences in the index.
+     * \param max_length An upper bound for the sequence lengths in the index.
+     * \param max_offset The maximum positional offset of all motifs, which is added to the positions.
+     * \param num_motifs The number of motifs.
+     * \throws std::runtime_error if the fields do not fit into 64 bits.
      */
-    explicit BiDirectionalIndex(unsigned char xdrop):
-        index{},
-        names{},
-        cursors{},
-        scores{},
-        max_offset{},
-        xdrop_dist{xdrop}
+    explicit HitEncoding(size_t num_seq = 1u,
+                         size_t max_length = 1u,
+                         size_t max_offset = 0u,
+                         size_t num_motifs = 1u) :
+        max_length{max_length}
+    {
+        pos_shift = score_bits + bit_width(num_motifs);
+        seq_shift = pos_shift + bit_width(max_length + max_offset) + 1u;
+        if (seq_shift + bit_width(num_seq) > 64u)
+            throw std::runtime_error("The index contains " + std::to_string(num_seq) + " sequences of up to " +
+                                     std::to_string(max_length) + " nucleotides, which is too many for encoding the "
+                                     "hits of " + std::to_string(num_motifs) + " motifs.");
+    }
+
+    //! \brief Encode a hit into a key.
+    [[nodiscard]] uint64_t encode(size_t seq,
+                                  size_t pos,
+                                  bool reverse = false,
+                                  uint8_t midx = 0,
+                                  float score = 0.f) const
+    {
+        assert(pos < strand_bit() >> pos_shift);
+        assert(midx < uint64_t{1} << (pos_shift - score_bits));
+        float const fixed = std::clamp(score * score_factor, 0.f, static_cast<float>(UINT16_MAX));
+        return (seq_shift < 64 ? uint64_t{seq} << seq_shift : 0u) | (reverse ? strand_bit() : 0u) |
+               uint64_t{pos} << pos_shift | uint64_t{midx} << score_bits | static_cast<uint64_t>(std::lround(fixed));
+    }
+
+    //! \brief The sequence number of a key.
+    [[nodiscard]] size_t seq(uint64_t key) const
+    {
+        return seq_shift < 64 ? key >> seq_shift : 0u;
+    }
+
+    //! \brief The position of a key.
+    [[nodiscard]] size_t pos(uint64_t key) const
+    {
+        return (key & (strand_bit() - 1u)) >> pos_shift;
+    }
+
+    //! \brief Whether a key belongs to the reverse strand.
+    [[nodiscard]] bool reverse(uint64_t key) const
+    {
+        return (key & strand_bit()) != 0u;
+    }
+
+    //! \brief The motif of a key.
+    [[nodiscard]] uint8_t midx(uint64_t key) const
+    {
+        return (key & ((uint64_t{1} << pos_shift) - 1u)) >> score_bits;
+    }
+
+    //! \brief The score of a key.
+    [[nodiscard]] float score(uint64_t key) const
+    {
+        return static_cast<float>(key & UINT16_MAX) / score_factor;
+    }
+
+    /*!
+     * \brief Map a position of the forward strand to the reverse strand and vice versa.
+     *
+     * \details
+     * Mirrored positions increase in 5' to 3' direction of the reverse strand. The mirror axis lies at the end of the
+     * longest sequence, such that the offsets added to mirrored positions fit into the position field.
+     */
+    [[nodiscard]] size_t mirror(size_t pos) const
     {
-        scores.emplace_back(0);
+        return max_length - 1u - pos;
     }
+};
+
+//! \brief The final state of a successful search path, whose occurrences are located later.
+struct SearchLeaf
+{
+    seqan3::bi_fm_index_cursor<Index> cursor; //!< The cursor of the complete query.
+    float score;                              //!< The score of the query.
+    uint64_t hash;                            //!< The hash of the query, see BiDirectionalSearch::query_hash().
+};
+
+//! \brief A list of search leaves.
+using LeafList = std::vector<SearchLeaf>;
+
+/*!
+ * \brief Merge the leaves that refer to the same suffix array interval, keeping the best score.
+ * \param leaves The leaves of a single motif in a single shard; their order is not preserved.
+ */
+void merge_leaves(LeafList & leaves);
+
+/*!
+ * \brief Merge the hits that differ only in their score, keeping the best score.
+ * \param hits The hits, which must be sorted by key.
+ *
+ * \details
+ * Nested leaves of a motif, e.g. a query and its extension to the right, report the same positions.
+ * Their suffix array intervals are not accessible through the cursor, hence they are located separately
+ * and the resulting duplicates are removed here.
+ */
+void merge_hits(std::vector<HitRecord> & hits);
+
+/*!
+ * \brief Locate the occurrences of a search leaf.
+ * \param[out] hits The position where the hits are written; there must be room for `leaf.cursor.count()` hits.
+ * \param[in] leaf The leaf to be located.
+ * \param[in] first_seq The global number of the first sequence in the shard of the leaf.
+ * \param[in] motif The motif for which the results are reported.
+ * \param[in] max_offset The maximum positional offset of all motifs.
+ * \param[in] encoding The encoding of the hit keys.
+ * \param[in] reverse Whether the leaf matches the reverse complement of the motif, i.e. the reverse strand.
+ */
+void locate_leaf(HitRecord * hits,
+                 SearchLeaf const & leaf,
+                 size_t first_seq,
+                 StemloopMotif const & motif,
+                 size_t max_offset,
+                 HitEncoding const & encoding,
+                 bool reverse = false);
+
+//! \brief The index of a genome, which may consist of several shards.
+class BiDirectionalIndex
+{
+private:
+    //! \brief The shards of the index, which cover consecutive ranges of sequences.
+    std::vector<IndexShard> shards;
+
+    //! \brief The names of the sequences in the index.
+    NamePool names;
+
+    //! \brief The packed genome, which is only present if it is stored in the index file.
+    PackedGenome text;
+
+    //! \brief The sources from which the index was built.
+    IndexSources sources;
+
+    /*!
+     * \brief Build the index from the genome and the appended files in `sources` and write it to disk.
+     * \param filepath The filepath to the genome file.
+     * \param options The options that control the index construction.
+     */
+    void build(std::filesystem::path const & filepath, IndexOptions const & options);
+
+    /*!
+     * \brief Build the index from a genome that has already been read, and write it to disk.
+     * \param genome The sequences of the genome and all appended files, whose names are in `names`.
+     * \param filepath The filepath to the genome file.
+     * \param options The options that control the index construction.
+     */
+    void build(PackedGenome && genome, std::filesystem::path const & filepath, IndexOptions const & options);
+
+public:
+    //! \brief Constructor for an empty index.
+    BiDirectionalIndex():
+        shards{},
+        names{},
+        text{},
+        sources{}
+    {}
 
     /*!
      * \brief Create an index of a genome from the specified file.
      * \param filepath The filepath to the file.
+     * \param options The options that control the index construction.
      * \return a valid index of the genome.
      * \throws seqan3::file_open_error if neither `filepath` nor `filepath.marsindex` exist.
      *
@@ -76,46 +271,52 @@ public:
      * 1. If `filepath.marsindex` exists: Read the already created index from this file.
      * 2. Else if `filepath` exists: Read sequences from this file, create an index
      *    and write the index to `filepath.marsindex`.
+     *
+     * A new index is split into `options.shards` shards, or more if a single shard exceeds the memory limit.
+     * The shards are built concurrently. If the genome has changed, the index is rebuilt including all
+     * sequences that were appended.
      */
-    void create(std::filesystem::path const & filepath);
+    void create(std::filesystem::path const & filepath, IndexOptions const & options = {});
 
     /*!
-     * \brief Append a character to the 5' (left) side of the query.
-     * \param item The character to be added.
-     * \param left Whether the loop is at the 5' side.
-     * \returns whether the operation was successful.
+     * \brief Add the sequences of a FASTA file to the index of a genome, without rebuilding the existing index.
+     * \param filepath The filepath to the genome file.
+     * \param appendpath The filepath to the FASTA file with the new sequences.
+     * \param options The options that control the index construction.
+     * \throws seqan3::file_open_error if the genome or the new sequences cannot be found.
+     *
+     * \details
+     * The index is loaded or created as in create(). The new sequences are indexed as an additional segment,
+     * which is searched together with the existing ones, and the updated index is written to disk.
      */
-    bool append_loop(std::pair<float, seqan3::rna4> item, bool left);
+    void append(std::filesystem::path const & filepath,
+                std::filesystem::path const & appendpath,
+                IndexOptions const & options = {});
 
     /*!
-     * \brief Append a character pair at both sides of the query.
-     * \param stem_item The score and characters to be added.
-     * \returns whether the operation was successful.
-     */
-    bool append_stem(std::pair<float, bi_alphabet<seqan3::rna4>> stem_item);
-
-    //! \brief Revert the previous append step, which shrinks the query by one or two characters.
-    void backtrack();
-
-    /*!
-     * \brief Whether the search should be aborted through the xdrop condition.
-     * \return True if the score dropped over the previous x elements, false otherwise.
+     * \brief Rebuild the index of a genome, such that all appended segments are merged into the base segment.
+     * \param filepath The filepath to the genome file.
+     * \param options The options that control the index construction.
+     * \throws seqan3::file_open_error if the genome or an appended file cannot be found.
+     *
+     * \details
+     * The index file is replaced atomically, such that it can run in the background of a search.
+     * If the index file stores the genome text, the sequences are taken from there instead of the FASTA files.
      */
-    [[nodiscard]] bool xdrop() const;
+    void compact(std::filesystem::path const & filepath, IndexOptions const & options = {});
 
-    /*!
-     * \brief Perform the search with the current query and store the result in `hits`.
-     * \param[out] hits The result vector.
-     * \param[in] motif The motif for which the results are reported.
-     */
-    void compute_hits(std::vector<std::vector<Hit>> & hits, StemloopMotif const & motif) const;
+    //! \brief The number of segments, i.e. the base index and the appended files that are not compacted yet.
+    size_t number_of_segments() const
+    {
+        return sources.segments();
+    }
 
     /*!
      * \brief Access a sequence name.
      * \param idx The position of the sequence.
      * \return the name of the queried sequence.
      */
-    std::string const & get_name(size_t idx) const
+    std::string_view get_name(size_t idx) const
     {
         return names[idx];
     }
@@ -129,23 +330,227 @@ public:
         return names.size();
     }
 
+    //! \brief Whether the packed genome is stored in the index, which is required for extract().
+    bool has_text() const
+    {
+        return text.number_of_seq() > 0;
+    }
+
+    /*!
+     * \brief Extract a part of a sequence from the packed genome.
+     * \param seq The position of the sequence.
+     * \param begin The first position of the requested range.
+     * \param end The position behind the requested range.
+     * \return the nucleotides of the range, which is clipped at the sequence end; empty if the text is not stored.
+     */
+    std::vector<seqan3::dna4> extract(size_t seq, size_t begin, size_t end) const;
+
+    /*!
+     * \brief Access the number of shards in the index.
+     * \return the number of shards
+     */
+    size_t number_of_shards() const
+    {
+        return shards.size();
+    }
+
+    /*!
+     * \brief Access a shard of the index.
+     * \param idx The position of the shard.
+     * \return the shard.
+     */
+    IndexShard const & shard(size_t idx) const
+    {
+        return shards[idx];
+    }
+};
+
+//! \brief The extensions of a query by each character at one side, which are computed together.
+struct LoopChildren
+{
+    std::array<seqan3::bi_fm_index_cursor<Index>, 4> cursors{}; //!< The extended cursor for each character rank.
+    uint8_t valid{0};                                             //!< A bit mask of the characters that occur.
+};
+
+/*!
+ * \brief Provides a bi-directional search step-by-step with backtracking in one shard of an index.
+ *
+ * \details
+ * The object holds the mutable state of a single search, whereas the index is only read.
+ * Hence, several searches can be performed concurrently on the same index, each with an object of its own.
+ */
+class BiDirectionalSearch
+{
+private:
+    //! \brief The index shard in which the search is performed.
+    IndexShard const * shard;
+
+    //! \brief The stack of cursors (needed for backtracking), which is preallocated and never shrinks.
+    std::vector<seqan3::bi_fm_index_cursor<Index>> cursors;
+
+    //! \brief The stack of scores, which has the same size as the cursor stack.
+    std::vector<float> scores;
+
+    //! \brief The stack of polynomial hashes of the query, i.e. the sum of `(rank + 1) * base^i` over positions `i`.
+    std::vector<uint64_t> hashes;
+
+    //! \brief The stack of `base^length` of the query, which is needed to extend the hash to the right.
+    std::vector<uint64_t> powers;
+
+    //! \brief The stack of loop extensions of each query, see compute_loop_children().
+    std::vector<LoopChildren> children;
+
+    //! \brief The position of the current cursor and score in the stacks.
+    size_t depth;
+
+    //! \brief The base of the query hash.
+    static constexpr uint64_t hash_base{0x9E3779B97F4A7C15ull};
+
+    //! \brief The xdrop parameter.
+    unsigned char const xdrop_dist;
+
+    //! \brief Provide a free slot on top of the stacks, which only allocates if the capacity is exceeded.
+    void ensure_capacity()
+    {
+        if (depth + 1 == cursors.size())
+        {
+            cursors.push_back(cursors[depth]);
+            children.emplace_back();
+            scores.push_back(0.f);
+            hashes.push_back(0u);
+            powers.push_back(1u);
+        }
+    }
+
+    //! \brief Update the hash in the free slot for a character that is added to the left of the query.
+    void hash_left(uint64_t rank)
+    {
+        hashes[depth + 1] = hashes[depth + 1] * hash_base + rank + 1;
+        powers[depth + 1] *= hash_base;
+    }
+
+    //! \brief Update the hash in the free slot for a character that is added to the right of the query.
+    void hash_right(uint64_t rank)
+    {
+        hashes[depth + 1] += (rank + 1) * powers[depth + 1];
+        powers[depth + 1] *= hash_base;
+    }
+
+    //! \brief Make the extended cursor in the free slot the current one, after a loop character was added.
+    void push_loop(std::pair<float, seqan3::rna4> item, bool left);
+
+    //! \brief Make the extended cursor in the free slot the current one, after a base pair was added.
+    void push_stem(std::pair<float, bi_alphabet<seqan3::rna4>> stem_item);
+
+public:
+    /*!
+     * \brief Constructor for a bi-directional search.
+     * \param shard The index shard in which the search is performed.
+     * \param xdrop The xdrop parameter.
+     * \param max_steps The maximum number of append steps, for which the stacks are preallocated.
+     */
+    BiDirectionalSearch(IndexShard const & shard, unsigned char xdrop, size_t max_steps = 0):
+        shard{&shard},
+        cursors(max_steps + 1),
+        scores(max_steps + 1, 0.f),
+        hashes(max_steps + 1, 0u),
+        powers(max_steps + 1, 1u),
+        children(max_steps + 1),
+        depth{0},
+        xdrop_dist{xdrop}
+    {
+        cursors[0] = seqan3::bi_fm_index_cursor<Index>{shard.index};
+    }
+
+    //! \brief Revert all append steps and continue in the given shard, such that the stacks are reused.
+    void reset(IndexShard const & new_shard)
+    {
+        shard = &new_shard;
+        cursors[0] = seqan3::bi_fm_index_cursor<Index>{new_shard.index};
+        depth = 0;
+    }
+
+    /*!
+     * \brief Extend the query at one side with the wanted characters, to be appended with append_child(),
+     *        or with append_stem_child() for the 5' bases of a stem.
+     * \param wanted A bit mask of the character ranks that are needed.
+     * \param left Whether the loop is at the 5' side.
+     *
+     * \details
+     * Each wanted character is extended separately, because the cursor does not expose the rank queries of all
+     * characters at once. The extensions partition the occurrences of the query, apart from those that reach the
+     * end of a sequence. As soon as the extensions cover all occurrences, the remaining characters cannot occur
+     * and are skipped. The children are computed once per step and shared by all candidates of the step.
+     */
+    void compute_loop_children(uint8_t wanted, bool left);
+
+    /*!
+     * \brief Append a character whose extension was computed by the last call of compute_loop_children().
+     * \param item The character to be added, which must be in the wanted set of that call.
+     * \param left Whether the loop is at the 5' side, as in that call.
+     * \returns whether the operation was successful.
+     */
+    bool append_child(std::pair<float, seqan3::rna4> item, bool left);
+
+    /*!
+     * \brief Append a character pair, whose 5' base was extended by the last call of compute_loop_children().
+     * \param stem_item The score and characters to be added; the 5' base must be in the wanted set of that call,
+     *                  which must have extended to the left.
+     * \returns whether the operation was successful.
+     *
+     * \details
+     * The pairs with the same 5' base share the left extension, such that only the 3' base is extended.
+     */
+    bool append_stem_child(std::pair<float, bi_alphabet<seqan3::rna4>> stem_item);
+
+    //! \brief Revert the previous append step, which shrinks the query by one or two characters.
+    void backtrack()
+    {
+        assert(depth > 0);
+        --depth;
+    }
+
     /*!
-     * \brief Update the maximum offset of the motif.
-     * \param new_offset The proposed new offset value that is used if it is larger.
+     * \brief Whether the search should be aborted through the xdrop condition.
+     * \return True if the score dropped over the previous x elements, false otherwise.
      */
-    void update_max_offset(size_t new_offset)
+    [[nodiscard]] bool xdrop() const;
+
+    //! \brief The score of the current query.
+    [[nodiscard]] float score() const
+    {
+        return scores[depth];
+    }
+
+    /*!
+     * \brief The score of a previous query, relative to the current score.
+     * \param back The number of append steps to go back, at least 1.
+     * \return the score difference; -infinity if the query has fewer append steps.
+     */
+    [[nodiscard]] float previous_score(size_t back) const
+    {
+        return back > depth ? -std::numeric_limits<float>::infinity() : scores[depth - back] - scores[depth];
+    }
+
+    //! \brief A hash of the current query, which is equal for equal queries regardless of the extension order.
+    [[nodiscard]] uint64_t query_hash() const
+    {
+        return hashes[depth];
+    }
+
+    //! \brief The cursor of the current query.
+    [[nodiscard]] seqan3::bi_fm_index_cursor<Index> const & cursor() const
     {
-        if (new_offset > max_offset)
-            max_offset = new_offset;
+        return cursors[depth];
     }
 
     /*!
-     * \brief Retrieve the maximum positional offset of the motif.
-     * \return the maximum offset of the motif.
+     * \brief Record the current query as a leaf, which is located later with locate_leaf().
+     * \param[out] leaves The list where the leaf is appended.
      */
-    size_t get_max_offset() const
+    void record_leaf(LeafList & leaves) const
     {
-        return max_offset;
+        leaves.push_back(SearchLeaf{cursors[depth], scores[depth], hashes[depth]});
     }
 };
 
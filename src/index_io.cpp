@@ -1,19 +1,56 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <streambuf>
+#include <unistd.h>
+
 #include <seqan3/alphabet/nucleotide/dna15.hpp>
 #include <seqan3/io/sequence_file/input.hpp>
 
 #ifdef SEQAN3_HAS_ZLIB
     #include <seqan3/contrib/stream/gz_istream.hpp>
     #include <seqan3/contrib/stream/gz_ostream.hpp>
+    #include <zlib.h>
 #endif
 
 #include "index_io.hpp"
+#include "mapped_file.hpp"
 
 namespace mars
 {
 
-void read_genome(std::vector<seqan3::dna4_vector> & seqs,
-                 std::vector<std::string> & names,
-                 std::filesystem::path const & filepath)
+//! \brief The magic bytes at the beginning of a memory-mappable index file.
+static constexpr std::array<char, 8> index_magic{'M', 'A', 'R', 'S', 'I', 'D', 'X', '\0'};
+
+//! \brief The current version of the memory-mappable index format.
+static constexpr uint32_t index_format_version{6};
+
+//! \brief The magic bytes at the beginning of a block-compressed index file.
+static constexpr std::array<char, 8> compressed_magic{'M', 'A', 'R', 'S', 'B', 'G', 'Z', '\0'};
+
+//! \brief The current version of the block-compressed index container.
+static constexpr uint32_t compressed_format_version{2};
+
+//! \brief The uncompressed size of a block in a block-compressed index file.
+static constexpr uint64_t compressed_block_size{1u << 20};
+
+//! \brief A read-only stream buffer that reads directly from a memory region without copying it first.
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+    MemoryStreamBuf(char const * first, size_t length)
+    {
+        char * begin = const_cast<char *>(first);
+        setg(begin, begin, begin + length);
+    }
+};
+
+void read_genome(PackedGenome & genome, NamePool & names, std::filesystem::path const & filepath)
 {
     struct dna4_traits : seqan3::sequence_file_input_default_traits_dna
     {
@@ -24,39 +61,784 @@ void read_genome(std::vector<seqan3::dna4_vector> & seqs,
 
     for (auto & [seq, name] : SeqInput{filepath})
     {
-        seqs.push_back(std::move(seq));
-        names.push_back(std::move(name));
+        genome.append(seq);
+        names.push_back(name);
     }
 }
 
-void write_index(Index const & index, std::vector<std::string> const & names, std::filesystem::path & indexpath)
+// private helper function for write_index
+void write_padding(std::ostream & os)
+{
+    static char const zeros[8]{};
+    auto const remainder = static_cast<size_t>(os.tellp()) % 8;
+    if (remainder != 0)
+        os.write(zeros, 8 - remainder);
+}
+
+// private helper function for write_index
+void write_index_content(std::ostream & ofs,
+                         IndexHeader & header,
+                         std::vector<ShardEntry> & entries,
+                         std::vector<IndexShard> const & shards,
+                         NamePool const & names,
+                         PackedGenome const * text,
+                         IndexSources const & sources)
 {
+    // The header and shard table are written as given and their offsets are recorded while writing.
+    ofs.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    header.shards_offset = ofs.tellp();
+    ofs.write(reinterpret_cast<char const *>(entries.data()), entries.size() * sizeof(ShardEntry));
+
+    // the shard indices
+    for (size_t idx = 0; idx < shards.size(); ++idx)
+    {
+        write_padding(ofs);
+        entries[idx].first_seq = shards[idx].first_seq;
+        entries[idx].num_seq = shards[idx].num_seq;
+        entries[idx].index_offset = ofs.tellp();
+        {
+            cereal::BinaryOutputArchive oarchive{ofs};
+            oarchive(shards[idx].index);
+        }
+        entries[idx].index_size = static_cast<uint64_t>(ofs.tellp()) - entries[idx].index_offset;
+    }
+    write_padding(ofs);
+
+    // the name table: offsets followed by the characters
+    header.names_offset = ofs.tellp();
+    ofs.write(reinterpret_cast<char const *>(names.offset_data()), (names.size() + 1) * sizeof(uint64_t));
+    ofs.write(names.char_data(), names.num_chars());
+    header.names_size = static_cast<uint64_t>(ofs.tellp()) - header.names_offset;
+    write_padding(ofs);
+
+    // the source table in the same layout as the name table
+    NamePool paths{};
+    for (std::filesystem::path const & path : sources.appended)
+        paths.push_back(path.string());
+    header.sources_offset = ofs.tellp();
+    ofs.write(reinterpret_cast<char const *>(paths.offset_data()), (paths.size() + 1) * sizeof(uint64_t));
+    ofs.write(paths.char_data(), paths.num_chars());
+    header.sources_size = static_cast<uint64_t>(ofs.tellp()) - header.sources_offset;
+
+    // the packed genome: start positions followed by the words
+    if (text != nullptr)
+    {
+        write_padding(ofs);
+        header.text_offset = ofs.tellp();
+        ofs.write(reinterpret_cast<char const *>(text->start_data()), (text->number_of_seq() + 1) * sizeof(uint64_t));
+        ofs.write(reinterpret_cast<char const *>(text->word_data()), text->number_of_words() * sizeof(uint64_t));
+        header.text_size = static_cast<uint64_t>(ofs.tellp()) - header.text_offset;
+    }
+}
+
 #ifdef SEQAN3_HAS_ZLIB
-    indexpath += ".gz";
+/*!
+ * \brief An output stream buffer that writes a block-compressed index file while the content is streamed.
+ *
+ * \details
+ * The buffer holds one uncompressed and one compressed block per thread, which are compressed concurrently
+ * whenever the buffer is full. A block is stored uncompressed if compression does not shrink it, and so are the
+ * blocks of the patchable prefix that leave the buffer before the stream is finished, such that the index header
+ * and the shard table can be filled in with patch() after streaming the content. The block offset table is appended
+ * after the last block and the container header is written when the stream is finished.
+ */
+class BlockCompressStreamBuf : public std::streambuf
+{
+private:
+    std::ostream & ofs;
+    uint64_t raw_prefix;
+    unsigned int threads;
+    std::vector<char> buffer;
+    std::vector<std::vector<Bytef>> blocks;
+    std::vector<uint64_t> offsets;
+    uint64_t consumed{0};
+    uint64_t file_offset{sizeof(CompressedHeader)};
+
+    // Compress the buffered blocks concurrently and append them to the file.
+    bool flush_blocks(bool final)
+    {
+        uint64_t const length = pptr() - pbase();
+        uint32_t const num_blocks = (length + compressed_block_size - 1) / compressed_block_size;
+        bool success = true;
+        #pragma omp parallel for num_threads(threads) schedule(static)
+        for (uint32_t idx = 0; idx < num_blocks; ++idx)
+        {
+            uint64_t const first = idx * compressed_block_size;
+            uLong const block_length = std::min<uint64_t>(compressed_block_size, length - first);
+            auto const * source = reinterpret_cast<Bytef const *>(buffer.data() + first);
+            bool const patchable = !final && consumed + first < raw_prefix;
+            uLongf block_size = blocks[idx].capacity();
+            blocks[idx].resize(block_size);
+            if (!patchable && compress2(blocks[idx].data(), &block_size, source, block_length,
+                                        Z_DEFAULT_COMPRESSION) != Z_OK)
+            {
+                #pragma omp atomic write
+                success = false;
+            }
+            else if (patchable || block_size >= block_length)
+            {
+                blocks[idx].assign(source, source + block_length); // stored uncompressed
+            }
+            else
+            {
+                blocks[idx].resize(block_size);
+            }
+        }
+
+        for (uint32_t idx = 0; success && idx < num_blocks; ++idx)
+        {
+            offsets.push_back(file_offset);
+            file_offset += blocks[idx].size();
+            ofs.write(reinterpret_cast<char const *>(blocks[idx].data()), blocks[idx].size());
+        }
+        consumed += length;
+        setp(buffer.data(), buffer.data() + buffer.size());
+        return success && ofs.good();
+    }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (!flush_blocks(false))
+            return traits_type::eof();
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override
+    {
+        if (dir != std::ios_base::cur || off != 0)
+            return pos_type(off_type(-1));
+        return pos_type(consumed + (pptr() - pbase()));
+    }
+
+public:
+    /*!
+     * \brief Start a block-compressed index file.
+     * \param ofs The file stream, which must be positioned at the beginning.
+     * \param raw_prefix The number of bytes at the beginning of the content that can be patched.
+     * \param threads The number of threads for compressing.
+     */
+    BlockCompressStreamBuf(std::ostream & ofs, uint64_t raw_prefix, unsigned int threads) :
+        ofs{ofs},
+        raw_prefix{raw_prefix},
+        threads{std::max(threads, 1u)},
+        buffer(this->threads * compressed_block_size),
+        blocks(this->threads)
+    {
+        for (std::vector<Bytef> & block : blocks)
+            block.reserve(compressBound(compressed_block_size));
+        setp(buffer.data(), buffer.data() + buffer.size());
+
+        // placeholder for the container header, which is written when the stream is finished
+        CompressedHeader const header{};
+        ofs.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    }
+
+    //! \brief Overwrite a range of the patchable prefix of the content. Returns whether the range could be written.
+    bool patch(uint64_t offset, char const * data, uint64_t count)
+    {
+        if (offset + count > raw_prefix)
+            return false;
+
+        // the part that is still buffered
+        if (offset + count > consumed)
+        {
+            uint64_t const begin = std::max(offset, consumed);
+            std::memcpy(pbase() + (begin - consumed), data + (begin - offset), offset + count - begin);
+            count = begin - offset;
+        }
+
+        // the part in the uncompressed blocks at the beginning of the file
+        if (count > 0u)
+        {
+            ofs.seekp(sizeof(CompressedHeader) + offset);
+            ofs.write(data, count);
+            ofs.seekp(0, std::ios::end);
+        }
+        return ofs.good();
+    }
+
+    //! \brief Compress the remaining content and write the block offsets. Returns whether the file is complete.
+    bool finish()
+    {
+        if (!flush_blocks(true))
+            return false;
+
+        // The offset table is aligned at the end of the file, followed by nothing else.
+        offsets.push_back(file_offset);
+        static char const zeros[8]{};
+        ofs.write(zeros, (8 - file_offset % 8) % 8);
+        ofs.write(reinterpret_cast<char const *>(offsets.data()), offsets.size() * sizeof(uint64_t));
+
+        CompressedHeader const header{compressed_magic, compressed_format_version,
+                                      static_cast<uint32_t>(offsets.size() - 1), compressed_block_size, consumed};
+        ofs.seekp(0);
+        ofs.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        ofs.seekp(0, std::ios::end);
+        return ofs.good();
+    }
+};
+#endif
+
+// private helper function for write_index
+std::filesystem::path create_temporary_file(std::filesystem::path const & indexpath)
+{
+    // The file is created exclusively, such that concurrent writers of the same index never share it.
+    static std::atomic<uint64_t> counter{0};
+    std::random_device random{};
+    for (unsigned attempt = 0; attempt < 100u; ++attempt)
+    {
+        std::filesystem::path tmppath = indexpath;
+        tmppath += ".tmp." + std::to_string(::getpid()) + "." + std::to_string(counter++) + "." +
+                   std::to_string(random());
+        int const fd = ::open(tmppath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd >= 0)
+        {
+            ::close(fd);
+            return tmppath;
+        }
+        if (errno != EEXIST)
+            break;
+    }
+    return {};
+}
+
+GenomeInfo genome_file_info(std::filesystem::path const & filepath)
+{
+    GenomeInfo info{};
+    std::error_code ec{};
+    uintmax_t const size = std::filesystem::file_size(filepath, ec);
+    if (!ec)
+        info.file_size = size;
+    auto const mtime = std::filesystem::last_write_time(filepath, ec);
+    if (!ec)
+        info.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+    return info;
+}
+
+void write_index(std::vector<IndexShard> const & shards,
+                 NamePool const & names,
+                 PackedGenome const & text,
+                 IndexSources const & sources,
+                 std::filesystem::path const & indexpath,
+                 IndexOptions const & options)
+{
+    std::filesystem::path const tmppath = create_temporary_file(indexpath);
+    if (tmppath.empty())
+        return;
+    std::ofstream ofs{tmppath, std::ios::binary};
+    if (!ofs)
+    {
+        std::filesystem::remove(tmppath);
+        return;
+    }
+
+    bool compress = false;
+#ifdef SEQAN3_HAS_ZLIB
+    compress = options.compress;
 #endif
-    std::ofstream ofs{indexpath, std::ios::binary};
+    IndexHeader header{index_magic,
+                             index_format_version,
+                             static_cast<uint32_t>(shards.size()),
+                             sa_sampling_rate,
+                             static_cast<uint32_t>(sa_sampling_strategy),
+                             names.size(),
+                             sources.genome,
+                             static_cast<uint32_t>(options.shards),
+                             (compress ? 1u : 0u) | (options.store_text ? 2u : 0u),
+                             options.max_memory,
+                             0u, 0u, 0u,
+                             static_cast<uint32_t>(sources.appended.size()),
+                             static_cast<uint32_t>(sources.compacted),
+                             0u, 0u, 0u, 0u};
+    PackedGenome const * const stored_text = options.store_text ? &text : nullptr;
+
+    std::vector<ShardEntry> entries(shards.size(), ShardEntry{0u, 0u, 0u, 0u});
+
+#ifdef SEQAN3_HAS_ZLIB
+    if (compress)
+    {
+        // The index header and the shard table are filled in after streaming the content, thus they are stored
+        // uncompressed in case their blocks leave the buffer before.
+        BlockCompressStreamBuf compressor{ofs, sizeof(header) + entries.size() * sizeof(ShardEntry), options.threads};
+        std::ostream compressing_stream{&compressor};
+        write_index_content(compressing_stream, header, entries, shards, names, stored_text, sources);
+        if (!compressing_stream ||
+            !compressor.patch(0u, reinterpret_cast<char const *>(&header), sizeof(header)) ||
+            !compressor.patch(header.shards_offset, reinterpret_cast<char const *>(entries.data()),
+                              entries.size() * sizeof(ShardEntry)) ||
+            !compressor.finish())
+        {
+            ofs.setstate(std::ios::failbit);
+        }
+    }
+    else
+#endif
+    {
+        write_index_content(ofs, header, entries, shards, names, stored_text, sources);
+
+        // fill in the header and the shard table
+        ofs.seekp(0);
+        ofs.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        ofs.seekp(header.shards_offset);
+        ofs.write(reinterpret_cast<char const *>(entries.data()), entries.size() * sizeof(ShardEntry));
+        ofs.seekp(0, std::ios::end);
+    }
+    ofs.close();
+
     if (ofs)
+        std::filesystem::rename(tmppath, indexpath);
+    else
+        std::filesystem::remove(tmppath);
+}
+
+// private helper function for read_index
+bool has_index_magic(std::filesystem::path const & indexpath)
+{
+    std::array<char, 8> magic{};
+    std::ifstream ifs{indexpath, std::ios::binary};
+    return ifs.read(magic.data(), magic.size()) && (magic == index_magic || magic == compressed_magic);
+}
+
+/*!
+ * \brief The content of a memory-mappable index file.
+ *
+ * \details
+ * An uncompressed file is mapped into memory. A block-compressed file is inflated into a buffer, where the blocks
+ * are decompressed concurrently. An incomplete image inflates only the index header and the shard table at first,
+ * and further ranges on demand. The buffer is not initialized, such that the pages of the blocks that are never
+ * inflated do not occupy memory.
+ */
+class IndexImage
+{
+private:
+    //! \brief The mapped index file, which holds the blocks of a block-compressed file until they are inflated.
+    MappedFile file;
+
+    //! \brief The header of a block-compressed file.
+    CompressedHeader header{};
+
+    //! \brief The inflated content of a block-compressed file.
+    std::unique_ptr<char[]> buffer{};
+
+    //! \brief Whether each block of a block-compressed file has been inflated.
+    std::vector<uint8_t> inflated{};
+
+    //! \brief The offsets of the blocks in a block-compressed file, followed by the end of the last block.
+    uint64_t const * offsets{nullptr};
+
+#ifdef SEQAN3_HAS_ZLIB
+    //! \brief Inflate the blocks in the range [first, last) that have not been inflated yet.
+    bool inflate_blocks(uint64_t first, uint64_t last, unsigned int threads)
+    {
+        bool success = true;
+        #pragma omp parallel for num_threads(threads) schedule(dynamic)
+        for (uint64_t idx = first; idx < last; ++idx)
+        {
+            if (inflated[idx])
+                continue;
+            uint64_t const begin = idx * header.block_size;
+            uLongf length = std::min<uint64_t>(header.block_size, header.total_size - begin);
+            uLongf const expected = length;
+            if (header.version >= 2u && offsets[idx + 1] - offsets[idx] == expected)
+            {
+                std::memcpy(buffer.get() + begin, file.data() + offsets[idx], expected); // stored uncompressed
+                inflated[idx] = 1u;
+            }
+            else if (offsets[idx] > offsets[idx + 1] ||
+                          uncompress(reinterpret_cast<Bytef *>(buffer.get() + begin), &length,
+                                reinterpret_cast<Bytef const *>(file.data() + offsets[idx]),
+                                offsets[idx + 1] - offsets[idx]) != Z_OK ||
+                     length != expected)
+            {
+                #pragma omp atomic write
+                success = false;
+            }
+            else
+            {
+                inflated[idx] = 1u;
+            }
+        }
+        return success;
+    }
+#endif
+
+public:
+    /*!
+     * \brief Open an index file.
+     * \param indexpath The path of the index file.
+     * \param threads The number of threads for inflating a block-compressed file.
+     * \param complete Whether a block-compressed file is inflated completely; otherwise see inflate().
+     */
+    IndexImage(std::filesystem::path const & indexpath, unsigned int threads, bool complete = true) : file{indexpath}
     {
-        // Write the index to disk, including a version string.
+        if (!file.is_open() || file.size() < sizeof(header))
+            return;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (header.magic != compressed_magic)
+            return;
+
 #ifdef SEQAN3_HAS_ZLIB
-        seqan3::contrib::gz_ostream gzstream(ofs);
-        cereal::BinaryOutputArchive oarchive{gzstream};
+        // Version 1 stores the block offsets after the header, later versions at the end of the file.
+        uint64_t const table_size = (header.num_blocks + 1) * sizeof(uint64_t);
+        if (header.version == 0u ||
+            header.version > compressed_format_version ||
+            header.block_size == 0u ||
+            (header.total_size + header.block_size - 1) / header.block_size != header.num_blocks ||
+            sizeof(header) + table_size > file.size())
+        {
+            file = MappedFile{};
+            return;
+        }
+        uint64_t const table_offset = header.version == 1u ? sizeof(header) : file.size() - table_size;
+        offsets = reinterpret_cast<uint64_t const *>(file.data() + table_offset);
+        if (offsets[header.num_blocks] > (header.version == 1u ? file.size() : table_offset))
+        {
+            file = MappedFile{};
+            return;
+        }
+
+        buffer.reset(new char[header.total_size]);
+        inflated.assign(header.num_blocks, 0u);
+        bool success = complete ? inflate_blocks(0u, header.num_blocks, threads) : inflate(0u, sizeof(IndexHeader));
+        if (success && !complete)
+        {
+            IndexHeader index_header{};
+            std::memcpy(&index_header, buffer.get(), sizeof(index_header));
+            success = inflate(index_header.shards_offset, index_header.num_shards * sizeof(ShardEntry));
+        }
+
+        // The compressed blocks are not needed any more after inflating all of them.
+        if (!success)
+            buffer.reset();
+        if (!success || complete)
+            file = MappedFile{};
 #else
-        cereal::BinaryOutputArchive oarchive{ofs};
+        (void) threads;
+        (void) complete;
+        throw std::runtime_error("The index file " + indexpath.string() + " is block-compressed, but this program is "
+                                 "built without zlib. Use a build with zlib or remove the index file.");
 #endif
-        std::string const version{"1 mars bi_fm_index<dna4,collection>\n"};
-        oarchive(version);
-        oarchive(index);
-        oarchive(names);
+    }
+
+    /*!
+     * \brief Make a range of the index content available, which inflates the blocks that cover it if necessary.
+     * \param offset The first byte of the range.
+     * \param count The number of bytes in the range.
+     * \return whether the range is available.
+     */
+    bool inflate(uint64_t offset, uint64_t count)
+    {
+        if (!buffer)
+            return is_open() && offset <= size() && count <= size() - offset;
+        if (offset > header.total_size || count > header.total_size - offset)
+            return false;
+        if (count == 0u)
+            return true;
 #ifdef SEQAN3_HAS_ZLIB
-        gzstream.flush();
+        return file.is_open() && inflate_blocks(offset / header.block_size,
+                                                (offset + count - 1) / header.block_size + 1,
+                                                1u);
+#else
+        return false;
 #endif
     }
-    ofs.close();
+
+    //! \brief Drop a range of a mapped file from the resident memory, after it has been deserialized.
+    void release(size_t offset, size_t count) const noexcept
+    {
+        if (!buffer)
+            file.release(offset, count);
+    }
+
+    //! \brief Whether the index content is mapped from the file (not inflated).
+    [[nodiscard]] bool is_mapped() const noexcept
+    {
+        return !buffer && file.is_open();
+    }
+
+    //! \brief Whether the index content is available.
+    [[nodiscard]] bool is_open() const noexcept
+    {
+        return file.is_open() || buffer;
+    }
+
+    //! \brief The start of the index content.
+    [[nodiscard]] char const * data() const noexcept
+    {
+        return buffer ? buffer.get() : file.data();
+    }
+
+    //! \brief The size of the index content in bytes.
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return buffer ? header.total_size : file.size();
+    }
+};
+
+// private helper function for read_index and read_shard
+bool read_mapped_header(IndexHeader & header, IndexImage const & file)
+{
+    if (!file.is_open() || file.size() < sizeof(IndexHeader))
+        return false;
+
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != index_magic ||
+        header.version != index_format_version ||
+        header.sa_sampling != sa_sampling_rate ||
+        header.sa_strategy != static_cast<uint32_t>(sa_sampling_strategy) ||
+        header.shards_offset + header.num_shards * sizeof(ShardEntry) > file.size() ||
+        header.names_offset + header.names_size > file.size() ||
+        (header.num_seq + 1) * sizeof(uint64_t) > header.names_size ||
+        header.sources_offset + header.sources_size > file.size() ||
+        (header.num_sources + 1) * sizeof(uint64_t) > header.sources_size ||
+        header.compacted_sources > header.num_sources ||
+        header.text_offset + header.text_size > file.size() ||
+        (header.text_size > 0 && (header.num_seq + 1) * sizeof(uint64_t) > header.text_size))
+    {
+        return false;
+    }
+
+    // The shards must cover all sequences in consecutive order.
+    auto const * entries = reinterpret_cast<ShardEntry const *>(file.data() + header.shards_offset);
+    uint64_t next_seq{0};
+    for (uint32_t idx = 0; idx < header.num_shards; ++idx)
+    {
+        if (entries[idx].first_seq != next_seq ||
+            entries[idx].index_offset + entries[idx].index_size > file.size())
+        {
+            return false;
+        }
+        next_seq += entries[idx].num_seq;
+    }
+    return next_seq == header.num_seq;
 }
 
-bool read_index(Index & index, std::vector<std::string> & names, std::filesystem::path & indexpath)
+// private helper function for read_index and read_shard
+void load_shard(IndexShard & shard, IndexImage const & file, ShardEntry const & entry)
 {
+    // Deserialize the index straight from the mapped pages or the inflated buffer. The FM index owns its
+    // structures, so it is copied into heap memory and the mapped pages of the shard are not needed afterwards.
+    MemoryStreamBuf buffer{file.data() + entry.index_offset, entry.index_size};
+    std::istream stream{&buffer};
+    cereal::BinaryInputArchive iarchive{stream};
+    iarchive(shard.index);
+    file.release(entry.index_offset, entry.index_size);
+    shard.first_seq = entry.first_seq;
+    shard.num_seq = entry.num_seq;
+}
+
+// private helper function for read_index and read_index_sources
+void read_mapped_sources(IndexSources & sources, IndexImage const & file, IndexHeader const & header)
+{
+    auto const * offsets = reinterpret_cast<uint64_t const *>(file.data() + header.sources_offset);
+    char const * chars = reinterpret_cast<char const *>(offsets + header.num_sources + 1);
+    sources.genome = header.genome;
+    sources.compacted = header.compacted_sources;
+    sources.appended.clear();
+    for (uint32_t idx = 0; idx < header.num_sources; ++idx)
+        sources.appended.emplace_back(std::string{chars + offsets[idx], offsets[idx + 1] - offsets[idx]});
+}
+
+// private helper function for read_index and read_index_text
+bool read_mapped_names(NamePool & names, std::shared_ptr<IndexImage const> const & image, IndexHeader const & header)
+{
+    IndexImage const & file = *image;
+    auto const * offsets = reinterpret_cast<uint64_t const *>(file.data() + header.names_offset);
+    char const * chars = reinterpret_cast<char const *>(offsets + header.num_seq + 1);
+    if (offsets[header.num_seq] + (header.num_seq + 1) * sizeof(uint64_t) > header.names_size)
+        return false;
+
+    if (file.is_mapped())
+    {
+        // The names remain in the mapped file, such that only the accessed pages are loaded.
+        names = NamePool{offsets, chars, header.num_seq, image};
+    }
+    else
+    {
+        // Copy the names out of the inflated buffer, which can be released afterwards.
+        names.clear();
+        names.reserve(header.num_seq, offsets[header.num_seq]);
+        for (uint64_t idx = 0; idx < header.num_seq; ++idx)
+            names.push_back(std::string_view{chars + offsets[idx], offsets[idx + 1] - offsets[idx]});
+    }
+    return true;
+}
+
+// private helper function for read_index and read_index_text
+bool read_mapped_text(PackedGenome & text, std::shared_ptr<IndexImage const> const & image, IndexHeader const & header)
+{
+    text = PackedGenome{};
+    if (header.text_size == 0)
+        return false;
+
+    auto const * starts = reinterpret_cast<uint64_t const *>(image->data() + header.text_offset);
+    uint64_t const * words = starts + header.num_seq + 1;
+    uint64_t const num_words = (starts[header.num_seq] + 31) / 32;
+    if ((header.num_seq + 1 + num_words) * sizeof(uint64_t) > header.text_size)
+        return false;
+
+    // A mapped text refers to the file content, which is kept alive by the genome.
+    // The text is copied out of an inflated buffer, such that the buffer can be released afterwards.
+    text = PackedGenome{starts, words, header.num_seq, image};
+    if (!image->is_mapped())
+        text.make_owned();
+    return true;
+}
+
+// private helper function for read_index
+bool read_mapped_index(std::vector<IndexShard> & shards,
+                       NamePool & names,
+                       PackedGenome & text,
+                       IndexSources & sources,
+                       std::filesystem::path const & indexpath,
+                       unsigned int threads)
+{
+    auto const image = std::make_shared<IndexImage const>(indexpath, threads);
+    IndexImage const & file = *image;
+    IndexHeader header{};
+    if (!read_mapped_header(header, file))
+        return false;
+
+    // The shards are independent of each other and can be loaded concurrently.
+    auto const * entries = reinterpret_cast<ShardEntry const *>(file.data() + header.shards_offset);
+    shards.clear();
+    shards.resize(header.num_shards);
+    bool success = true;
+    #pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (uint32_t idx = 0; idx < header.num_shards; ++idx)
+    {
+        try
+        {
+            load_shard(shards[idx], file, entries[idx]);
+        }
+        catch (std::exception const &)
+        {
+            #pragma omp atomic write
+            success = false;
+        }
+    }
+    if (!success)
+        return false;
+
+    if (!read_mapped_names(names, image, header))
+        return false;
+    read_mapped_text(text, image, header);
+    read_mapped_sources(sources, file, header);
+    return true;
+}
+
+bool read_index_header(IndexHeader & header, std::filesystem::path const & indexpath)
+{
+    // Only the blocks of the index header and the shard table are inflated.
+    IndexImage const file{indexpath, 1u, false};
+    if (!file.is_open() || file.size() < sizeof(header))
+        return false;
+    std::memcpy(&header, file.data(), sizeof(header));
+    return header.magic == index_magic && header.version == index_format_version;
+}
+
+bool index_is_outdated(IndexHeader const & header, std::filesystem::path const & filepath)
+{
+    if (!std::filesystem::exists(filepath))
+        return false;
+    GenomeInfo const info = genome_file_info(filepath);
+    return info.file_size != header.genome.file_size || info.mtime != header.genome.mtime;
+}
+
+void print_index_info(std::ostream & out, IndexHeader const & header, std::filesystem::path const & filepath)
+{
+    out << "format version:   " << header.version << "\n"
+        << "sequences:        " << header.num_seq << "\n"
+        << "total length:     " << header.genome.total_length << "\n"
+        << "shards:           " << header.num_shards << "\n"
+        << "segments:         " << (1 + header.num_sources - header.compacted_sources)
+        << " (" << header.num_sources << " appended files)\n"
+        << "SA sampling:      " << header.sa_sampling << " ("
+        << (header.sa_strategy == static_cast<uint32_t>(SaSampling::text_order) ? "text order" : "SA order") << ")\n"
+        << "genome file size: " << header.genome.file_size << "\n"
+        << "genome checksum:  " << std::hex << header.genome.checksum << std::dec << "\n"
+        << "build options:    shards=" << header.build_shards << " max-memory=" << header.build_max_memory
+        << " compressed=" << ((header.build_flags & 1u) ? "yes" : "no")
+        << " store-text=" << ((header.build_flags & 2u) ? "yes" : "no") << "\n"
+        << "genome status:    ";
+    if (!std::filesystem::exists(filepath))
+        out << "unknown (genome file not found)\n";
+    else if (index_is_outdated(header, filepath))
+        out << "outdated (genome file has changed)\n";
+    else
+        out << "up to date\n";
+}
+
+bool read_index_text(NamePool & names, PackedGenome & text, std::filesystem::path const & indexpath)
+{
+    // Only the blocks of the names and the text are inflated.
+    auto const image = std::make_shared<IndexImage>(indexpath, 1u, false);
+    IndexHeader header{};
+    return read_mapped_header(header, *image) &&
+           image->inflate(header.names_offset, header.names_size) &&
+           image->inflate(header.text_offset, header.text_size) &&
+           read_mapped_names(names, image, header) &&
+           read_mapped_text(text, image, header);
+}
+
+bool read_index_sources(IndexSources & sources, std::filesystem::path const & indexpath)
+{
+    IndexImage file{indexpath, 1u, false};
+    IndexHeader header{};
+    if (!read_mapped_header(header, file) || !file.inflate(header.sources_offset, header.sources_size))
+        return false;
+
+    read_mapped_sources(sources, file, header);
+    return true;
+}
+
+bool read_shard(IndexShard & shard, std::filesystem::path const & indexpath, size_t shard_idx)
+{
+    // Only the blocks of the requested shard are inflated.
+    IndexImage file{indexpath, 1u, false};
+    IndexHeader header{};
+    if (!read_mapped_header(header, file) || shard_idx >= header.num_shards)
+        return false;
+
+    ShardEntry const entry = reinterpret_cast<ShardEntry const *>(file.data() + header.shards_offset)[shard_idx];
+    if (!file.inflate(entry.index_offset, entry.index_size))
+        return false;
+    load_shard(shard, file, entry);
+    return true;
+}
+
+bool read_index(std::vector<IndexShard> & shards,
+                NamePool & names,
+                PackedGenome & text,
+                IndexSources & sources,
+                std::filesystem::path & indexpath,
+                unsigned int threads)
+{
+    if (std::filesystem::exists(indexpath) && has_index_magic(indexpath))
+        return read_mapped_index(shards, names, text, sources, indexpath, threads);
+
+    // Fall back to the archive format of older versions, which contains a single index with default sampling.
+    text = PackedGenome{};
+    sources = IndexSources{};
+    shards.clear();
+    if constexpr (!default_sa_sampling)
+    {
+        // Refuse to overwrite an uncompressed archive, which cannot be read with this sampling.
+        if (std::filesystem::exists(indexpath))
+            throw std::runtime_error("The index file " + indexpath.string() + " is an archive of a previous version "
+                                     "with the default SA sampling, which this program cannot read.");
+        return false;
+    }
+
+    shards.emplace_back();
+    Index & index = shards.front().index;
+    std::vector<std::string> legacy_names{};
     bool success = false;
 #ifdef SEQAN3_HAS_ZLIB
     std::filesystem::path gzindexpath = indexpath;
@@ -72,7 +854,7 @@ bool read_index(Index & index, std::vector<std::string> & names, std::filesystem
             iarchive(version);
             assert(version[0] == '1');
             iarchive(index);
-            iarchive(names);
+            iarchive(legacy_names);
             success = true;
             indexpath = gzindexpath;
         }
@@ -89,11 +871,23 @@ bool read_index(Index & index, std::vector<std::string> & names, std::filesystem
             iarchive(version);
             assert(version[0] == '1');
             iarchive(index);
-            iarchive(names);
+            iarchive(legacy_names);
             success = true;
         }
         ifs.close();
     }
+
+    if (success)
+    {
+        names.clear();
+        for (std::string const & name : legacy_names)
+            names.push_back(name);
+        shards.front().num_seq = names.size();
+    }
+    else
+    {
+        shards.clear();
+    }
     return success;
 }
 
@@ -1,43 +1,302 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <iosfwd>
 #include <seqan3/std/filesystem>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <seqan3/alphabet/nucleotide/dna4.hpp>
 #include <seqan3/search/fm_index/bi_fm_index.hpp>
 
+#include "name_pool.hpp"
+#include "packed_genome.hpp"
+
 namespace mars
 {
 
+#ifndef MARS_SA_SAMPLING
+    #define MARS_SA_SAMPLING 16
+#endif
+
+//! \brief Every n-th suffix array value is stored in the index; smaller values speed up locate but need more space.
+static constexpr uint32_t sa_sampling_rate{MARS_SA_SAMPLING};
+
+//! \brief The strategy for sampling the suffix array.
+enum class SaSampling : uint32_t
+{
+    sa_order = 0,  //!< Sample every n-th entry of the suffix array (seqan3 default).
+    text_order = 1 //!< Sample the suffix array values of every n-th text position.
+};
+
+#ifdef MARS_SA_TEXT_ORDER
+static constexpr SaSampling sa_sampling_strategy{SaSampling::text_order};
+#else
+static constexpr SaSampling sa_sampling_strategy{SaSampling::sa_order};
+#endif
+
+//! \brief The underlying compressed suffix array, which equals the seqan3 default apart from the sampling.
+using SdslIndex = sdsl::csa_wt<sdsl::wt_blcd<sdsl::bit_vector,
+                                             sdsl::rank_support_v<>,
+                                             sdsl::select_support_scan<>,
+                                             sdsl::select_support_scan<0>>,
+                               sa_sampling_rate,
+                               10'000'000,
+                               std::conditional_t<sa_sampling_strategy == SaSampling::text_order,
+                                                  sdsl::text_order_sa_sampling<>,
+                                                  sdsl::sa_order_sa_sampling<>>,
+                               std::conditional_t<sa_sampling_strategy == SaSampling::text_order,
+                                                  sdsl::text_order_isa_sampling_support<>,
+                                                  sdsl::isa_sampling<>>,
+                               sdsl::plain_byte_alphabet>;
+
+//! \brief Whether the index type equals the one of previous versions, which did not record the sampling.
+static constexpr bool default_sa_sampling = std::is_same_v<SdslIndex, seqan3::default_sdsl_index_type>;
+
 //! \brief The type of a bi-directional index over the 4-letter DNA alphabet.
-using Index = seqan3::bi_fm_index<seqan3::dna4, seqan3::text_layout::collection>;
+using Index = seqan3::bi_fm_index<seqan3::dna4, seqan3::text_layout::collection, SdslIndex>;
+
+//! \brief The forward half of the bi-directional index.
+using ForwardIndex = seqan3::fm_index<seqan3::dna4, seqan3::text_layout::collection, SdslIndex>;
+
+//! \brief The reverse half of the bi-directional index, which is built over the reversed text.
+using ReverseIndex = seqan3::detail::reverse_fm_index<seqan3::dna4, seqan3::text_layout::collection, SdslIndex>;
+
+//! \brief Options that control how an index is built.
+struct IndexOptions
+{
+    //! \brief The maximum number of threads for building the index.
+    unsigned int threads{1};
+
+    //! \brief The memory budget for building the index in MiB; 0 means unlimited.
+    size_t max_memory{0};
+
+    //! \brief The number of shards into which the genome is split.
+    size_t shards{1};
+
+    //! \brief Whether the index file is block-compressed (requires zlib).
+    bool compress{false};
+
+    //! \brief The number of index segments that triggers a compaction in the background; 0 means never.
+    size_t max_segments{8};
+
+    //! \brief Whether a 2-bit packed copy of the genome is stored in the index file.
+    bool store_text{false};
+};
+
+//! \brief A part of a sharded index, which covers a range of consecutive sequences.
+struct IndexShard
+{
+    Index index{};       //!< The index over the sequences of this shard.
+    size_t first_seq{0}; //!< The global number of the first sequence in this shard.
+    size_t num_seq{0};   //!< The number of sequences in this shard.
+};
+
+//! \brief Describes the genome from which an index was built.
+struct GenomeInfo
+{
+    uint64_t file_size{0};      //!< The size of the genome file in bytes.
+    int64_t mtime{0};           //!< The last modification time of the genome file.
+    uint64_t checksum{0};       //!< A checksum of the genome sequences (see PackedGenome::checksum).
+    uint64_t total_length{0};   //!< The total number of nucleotides in the genome.
+};
+
+//! \brief The sources from which an index was built, which are needed to rebuild or compact it.
+struct IndexSources
+{
+    GenomeInfo genome{};                           //!< The genome file from which the index was built.
+    std::vector<std::filesystem::path> appended{}; //!< The FASTA files that were appended as segments.
+    size_t compacted{0};                           //!< The number of appended files that are merged into the base.
+
+    //! \brief The number of index segments, i.e. the base index and the appended files that are not compacted.
+    [[nodiscard]] size_t segments() const noexcept
+    {
+        return 1 + appended.size() - compacted;
+    }
+};
+
+/*!
+ * \brief The header of a memory-mappable index file.
+ *
+ * \details
+ * The header is followed by the shard table, the archived shard indices, the name table and the source table,
+ * each starting at an 8-byte aligned offset. The shard table consists of `num_shards` entries of type ShardEntry.
+ * The name table consists of `num_seq + 1` offsets (uint64_t) into the subsequent character array.
+ * The source table lists the paths of the appended FASTA files in the same layout.
+ * The optional text section holds the packed genome: `num_seq + 1` start positions followed by the packed words.
+ */
+struct IndexHeader
+{
+    std::array<char, 8> magic;  //!< Identifies the file format, must be "MARSIDX".
+    uint32_t version;           //!< The version of the file format.
+    uint32_t num_shards;        //!< The number of index shards.
+    uint32_t sa_sampling;       //!< The suffix array sampling rate of the index.
+    uint32_t sa_strategy;       //!< The suffix array sampling strategy of the index (see SaSampling).
+    uint64_t num_seq;           //!< The number of sequences in the index.
+    GenomeInfo genome;          //!< The genome from which the index was built.
+    uint32_t build_shards;      //!< The number of shards that was requested for building.
+    uint32_t build_flags;       //!< The build flags; bit 0: the file is block-compressed, bit 1: the text is stored.
+    uint64_t build_max_memory;  //!< The memory limit for building the index in MiB.
+    uint64_t shards_offset;     //!< The byte position of the shard table.
+    uint64_t names_offset;      //!< The byte position of the name table.
+    uint64_t names_size;        //!< The size of the name table in bytes.
+    uint32_t num_sources;       //!< The number of appended FASTA files.
+    uint32_t compacted_sources; //!< The number of appended FASTA files that are merged into the base segment.
+    uint64_t sources_offset;    //!< The byte position of the source table.
+    uint64_t sources_size;      //!< The size of the source table in bytes.
+    uint64_t text_offset;       //!< The byte position of the packed genome text.
+    uint64_t text_size;         //!< The size of the packed genome text in bytes; 0 if the text is not stored.
+};
+
+//! \brief An entry of the shard table in a memory-mappable index file.
+struct ShardEntry
+{
+    uint64_t first_seq;         //!< The global number of the first sequence in the shard.
+    uint64_t num_seq;           //!< The number of sequences in the shard.
+    uint64_t index_offset;      //!< The byte position of the archived shard index.
+    uint64_t index_size;        //!< The size of the archived shard index in bytes.
+};
+
+/*!
+ * \brief The header of a block-compressed index file.
+ *
+ * \details
+ * The header is followed by the blocks, each of which holds `block_size` bytes of a memory-mappable index file
+ * (the last block may be shorter). A block is an independent zlib stream, or the bytes themselves if its stored size
+ * equals its uncompressed size. The file ends with `num_blocks + 1` offsets (uint64_t) of the blocks in the file,
+ * where the last offset marks the end of the last block. In version 1 the offsets follow the header instead and
+ * every block is compressed.
+ */
+struct CompressedHeader
+{
+    std::array<char, 8> magic;  //!< Identifies the file format, must be "MARSBGZ".
+    uint32_t version;           //!< The version of the container format.
+    uint32_t num_blocks;        //!< The number of compressed blocks.
+    uint64_t block_size;        //!< The uncompressed size of a block in bytes.
+    uint64_t total_size;        //!< The uncompressed size of the index file in bytes.
+};
 
 /*!
  * \brief Read a FASTA file of sequences.
- * \param[out] seqs The object where the sequences can be stored.
+ * \param[out] genome The object where the sequences are appended in packed form.
  * \param[out] names The object where the sequence names can be stored.
  * \param[in] filepath The file path where the sequences and names can be read from.
+ *
+ * \details
+ * The records are read one at a time, such that only a single sequence is held in unpacked form.
+ */
+void read_genome(PackedGenome & genome, NamePool & names, std::filesystem::path const & filepath);
+
+/*!
+ * \brief Determine the size and modification time of a genome file.
+ * \param filepath The path of the genome file.
+ * \return the genome information, where the checksum and length are not set.
  */
-void read_genome(std::vector<seqan3::dna4_vector> & seqs,
-                 std::vector<std::string> & names,
-                 std::filesystem::path const & filepath);
+GenomeInfo genome_file_info(std::filesystem::path const & filepath);
 
 /*!
- * \brief Archive an index and store it in a file on disk.
- * \param[in] index The index that should be archived.
+ * \brief Store a sharded index in a memory-mappable file on disk.
+ * \param[in] shards The index shards that should be archived.
  * \param[in] names The sequence names.
+ * \param[in] text The packed genome, which is stored if `options.store_text` is set.
+ * \param[in] sources The sources of the index, which are stored in the header and the source table.
  * \param[in] indexpath The path of the index output file.
+ * \param[in] options The options, which determine whether the file is block-compressed and with how many threads.
+ *
+ * \details
+ * The file is written to a temporary location first and then renamed, such that concurrent processes
+ * never map an incomplete index.
  */
-void write_index(Index const & index, std::vector<std::string> const & names, std::filesystem::path & indexpath);
+void write_index(std::vector<IndexShard> const & shards,
+                 NamePool const & names,
+                 PackedGenome const & text,
+                 IndexSources const & sources,
+                 std::filesystem::path const & indexpath,
+                 IndexOptions const & options = {});
 
 /*!
- * \brief Unarchive an index and read it from a file on disk.
- * \param[out] index The index object which is filled with the contents of the file.
- * \param[out] names The sequence names.
- * \param[in] indexpath The path of the index input file.
+ * \brief Read a sharded index from a file on disk.
+ * \param[out] shards The index shards which are filled with the contents of the file.
+ * \param[out] names The sequence names, which refer to the mapped file if it is not compressed.
+ * \param[out] text The packed genome, which refers to the mapped file; is empty if the text is not stored.
+ * \param[out] sources The sources of the index; archives of older versions have no sources.
+ * \param[in,out] indexpath The path of the index input file; is updated to the file that was actually read.
+ * \param[in] threads The maximum number of threads for loading the shards concurrently.
  * \return whether an index could be parsed.
+ *
+ * \details
+ * Memory-mappable index files are preferred; block-compressed ones are inflated with `threads` threads.
+ * The shards are deserialized into heap memory, because the FM index owns its structures, and their mapped pages
+ * are released afterwards. Only the names and the stored text are accessed in place in a mapped file.
+ * Archives of older versions (`.marsindex` and `.marsindex.gz`) can still be read and result in a single shard,
+ * if the application is built with the default suffix array sampling. Files with a different sampling are rejected.
+ * Without zlib a block-compressed file raises a std::runtime_error, such that it is not rebuilt and overwritten.
+ */
+bool read_index(std::vector<IndexShard> & shards,
+                NamePool & names,
+                PackedGenome & text,
+                IndexSources & sources,
+                std::filesystem::path & indexpath,
+                unsigned int threads = 1u);
+
+/*!
+ * \brief Read only the header of an index file.
+ * \param[out] header The header.
+ * \param[in] indexpath The path of the index file.
+ * \return whether the file has a header of the current format version.
+ *
+ * \details
+ * For a block-compressed file only the blocks of the header and the shard table are inflated.
+ * Without zlib a block-compressed file raises a std::runtime_error.
+ */
+bool read_index_header(IndexHeader & header, std::filesystem::path const & indexpath);
+
+/*!
+ * \brief Read the sources of an index file without loading the index.
+ * \param[out] sources The sources of the index.
+ * \param[in] indexpath The path of the index file.
+ * \return whether the sources could be read.
+ */
+bool read_index_sources(IndexSources & sources, std::filesystem::path const & indexpath);
+
+/*!
+ * \brief Read the names and the packed genome of an index file without loading the index.
+ * \param[out] names The sequence names.
+ * \param[out] text The packed genome.
+ * \param[in] indexpath The path of the index file.
+ * \return whether the index file stores the packed genome.
+ */
+bool read_index_text(NamePool & names, PackedGenome & text, std::filesystem::path const & indexpath);
+
+/*!
+ * \brief Check whether the genome file has changed since the index was built.
+ * \param header The header of the index.
+ * \param filepath The path of the genome file.
+ * \return true if the genome file exists and its size or modification time differs from the recorded one.
+ */
+bool index_is_outdated(IndexHeader const & header, std::filesystem::path const & filepath);
+
+/*!
+ * \brief Print the information of an index header in human-readable form.
+ * \param out The output stream.
+ * \param header The header of the index.
+ * \param filepath The path of the genome file, which is checked for changes.
+ */
+void print_index_info(std::ostream & out, IndexHeader const & header, std::filesystem::path const & filepath);
+
+/*!
+ * \brief Read a single shard of a memory-mappable index file.
+ * \param[out] shard The shard which is filled with the contents of the file.
+ * \param[in] indexpath The path of the index file.
+ * \param[in] shard_idx The position of the shard in the file.
+ * \return whether the shard could be parsed.
+ *
+ * \details
+ * Of a block-compressed file, only the blocks that hold the header, the shard table and the shard are inflated.
+ * The FM index of the shard is deserialized into memory that it owns, the file content is not used in place.
  */
-bool read_index(Index & index, std::vector<std::string> & names, std::filesystem::path & indexpath);
+bool read_shard(IndexShard & shard, std::filesystem::path const & indexpath, size_t shard_idx);
 
 } // namespace mars
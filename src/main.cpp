@@ -5,6 +5,7 @@
 
 #include "index.hpp"
 #include "motif.hpp"
+#include "result_writer.hpp"
 #include "search.hpp"
 #include "settings.hpp"
 
@@ -20,10 +21,36 @@ int main(int argc, char ** argv)
     if (!settings.parse_arguments(argc, argv, out))
         return EXIT_FAILURE;
 
+    // Report the index information without loading the index
+    if (settings.index_info)
+    {
+        std::filesystem::path indexpath = settings.genome_file;
+        indexpath += ".marsindex";
+        mars::IndexHeader header{};
+        try
+        {
+            if (!mars::read_index_header(header, indexpath))
+            {
+                std::cerr << "Could not read the index information from " << indexpath << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        catch (std::runtime_error const & e)
+        {
+            std::cerr << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+        mars::print_index_info(out, header, settings.genome_file);
+        return EXIT_SUCCESS;
+    }
+
     // Start reading the genome and creating the index asyncronously
-    mars::BiDirectionalIndex bds{settings.xdrop};
-    std::future<void> index_future = std::async(std::launch::async, &mars::BiDirectionalIndex::create, &bds,
-                                                settings.genome_file);
+    mars::BiDirectionalIndex bds{};
+    std::future<void> index_future = settings.append_file.empty()
+        ? std::async(std::launch::async, &mars::BiDirectionalIndex::create, &bds,
+                     settings.genome_file, settings.index_options)
+        : std::async(std::launch::async, &mars::BiDirectionalIndex::append, &bds,
+                     settings.genome_file, settings.append_file, settings.index_options);
 
     // Generate motifs from the MSA
     std::vector<mars::StemloopMotif> motifs = mars::create_motifs(settings.alignment_file, settings.threads);
@@ -39,16 +66,39 @@ int main(int argc, char ** argv)
         return EXIT_FAILURE;
     }
 
+    // Merge the index segments in the background, while the search uses the current index.
+    std::future<void> compaction_future{};
+    if (settings.index_options.max_segments > 0u && bds.number_of_segments() > settings.index_options.max_segments)
+    {
+        if (mars::verbose > 0)
+            std::cerr << "Compact " << bds.number_of_segments() << " index segments in the background." << std::endl;
+        compaction_future = std::async(std::launch::async, [&settings] ()
+        {
+            mars::BiDirectionalIndex compacted{};
+            compacted.compact(settings.genome_file, settings.index_options);
+        });
+    }
+
     if (!motifs.empty() && !settings.genome_file.empty())
     {
-        mars::SearchGenerator search{bds, motifs.front().depth};
-        search.find_motifs(motifs);
-        out << " " << std::left << std::setw(35) << "sequence name" << "\t" << "index" << "\t"
-            << "pos" << "\t" << "n" << "\t" << "score" << std::endl;
-        for (mars::MotifLocation const & loc : search.get_locations())
+        try
+        {
+            mars::SearchGenerator search{bds, motifs.front().depth, settings.xdrop, settings.threads,
+                                         settings.split_depth, settings.min_score, settings.max_hits,
+                                         settings.min_hit_score, settings.strand == "both"};
+            mars::ResultWriter writer{out, settings.strand == "both"};
+            writer.write_header();
+            search.find_motifs(motifs, [&writer, &bds] (std::vector<mars::MotifLocation> const & locations)
+            {
+                for (mars::MotifLocation const & loc : locations)
+                    writer.write(bds.get_name(loc.sequence), loc);
+            });
+            writer.flush();
+        }
+        catch (std::runtime_error const & e)
         {
-            out << ">" << std::left << std::setw(35) << bds.get_name(loc.sequence) << "\t" << loc.sequence << "\t"
-                << loc.position << "\t" << +loc.num_stemloops << "\t" << loc.score << std::endl;
+            std::cerr << "The motif search failed: " << e.what() << "\n";
+            return EXIT_FAILURE;
         }
     }
     else if (motifs.empty() && mars::verbose > 0)
@@ -56,6 +106,18 @@ int main(int argc, char ** argv)
         std::cerr << "There are no motifs: skipping search step." << std::endl;
     }
 
+    if (compaction_future.valid())
+    {
+        try
+        {
+            compaction_future.get();
+        }
+        catch (std::exception const & e)
+        {
+            std::cerr << "The index compaction failed: " << e.what() << "\n";
+        }
+    }
+
     if (mars::verbose > 0)
     {
         auto const & sec = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - t0).count();
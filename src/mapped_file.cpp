@@ -0,0 +1,67 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include "mapped_file.hpp"
+
+namespace mars
+{
+
+MappedFile::MappedFile(std::filesystem::path const & filepath) : first{nullptr}, length{0}
+{
+    int const fd = ::open(filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat file_stat{};
+    if (::fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    {
+        void * addr = ::mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            first = static_cast<char const *>(addr);
+            length = static_cast<size_t>(file_stat.st_size);
+        }
+    }
+    ::close(fd); // the mapping stays valid after closing the descriptor
+}
+
+MappedFile::MappedFile(MappedFile && other) noexcept :
+    first{std::exchange(other.first, nullptr)},
+    length{std::exchange(other.length, 0)}
+{}
+
+MappedFile & MappedFile::operator=(MappedFile && other) noexcept
+{
+    if (this != &other)
+    {
+        if (first != nullptr)
+            ::munmap(const_cast<char *>(first), length);
+        first = std::exchange(other.first, nullptr);
+        length = std::exchange(other.length, 0);
+    }
+    return *this;
+}
+
+void MappedFile::release(size_t offset, size_t count) const noexcept
+{
+    if (first == nullptr || offset >= length)
+        return;
+
+    size_t const page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t const begin = (offset + page - 1) / page * page;
+    size_t const end = std::min(offset + count, length) / page * page;
+    if (begin < end)
+        ::madvise(const_cast<char *>(first + begin), end - begin, MADV_DONTNEED);
+}
+
+MappedFile::~MappedFile()
+{
+    if (first != nullptr)
+        ::munmap(const_cast<char *>(first), length);
+}
+
+} // namespace mars
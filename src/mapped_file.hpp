@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <seqan3/std/filesystem>
+
+namespace mars
+{
+
+/*!
+ * \brief A read-only memory mapping of a whole file.
+ *
+ * \details
+ * The mapping is shared with the page cache, such that several processes that map the same file
+ * use the same physical memory pages for the data that they access in place.
+ */
+class MappedFile
+{
+private:
+    //! \brief The start of the mapped memory region.
+    char const * first;
+
+    //! \brief The size of the mapped memory region.
+    size_t length;
+
+public:
+    /*!
+     * \name Constructors, destructor and assignment
+     * \{
+     */
+    MappedFile() noexcept : first{nullptr}, length{0} {} //!< An empty mapping.
+    MappedFile(MappedFile const &) = delete;             //!< Not copyable.
+    MappedFile & operator=(MappedFile const &) = delete; //!< Not copyable.
+    MappedFile(MappedFile && other) noexcept;            //!< Moves the mapping.
+    MappedFile & operator=(MappedFile && other) noexcept; //!< Moves the mapping.
+    ~MappedFile();                                       //!< Unmaps the file.
+    //!\}
+
+    /*!
+     * \brief Map a file into memory.
+     * \param filepath The path of the file.
+     *
+     * \details
+     * If the file cannot be opened or mapped, the object stays empty and `is_open()` returns false.
+     */
+    explicit MappedFile(std::filesystem::path const & filepath);
+
+    //! \brief Whether a file is mapped.
+    [[nodiscard]] bool is_open() const noexcept
+    {
+        return first != nullptr;
+    }
+
+    //! \brief The start of the mapped memory region.
+    [[nodiscard]] char const * data() const noexcept
+    {
+        return first;
+    }
+
+    //! \brief The size of the mapped memory region in bytes.
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return length;
+    }
+
+    /*!
+     * \brief Tell the system that a range of the file is not accessed anymore.
+     * \param offset The start of the range in bytes.
+     * \param count The size of the range in bytes.
+     *
+     * \details
+     * The pages that lie completely within the range are dropped from the resident memory of the process.
+     * They stay readable and are loaded again from the file if they are accessed later.
+     */
+    void release(size_t offset, size_t count) const noexcept;
+};
+
+} // namespace mars
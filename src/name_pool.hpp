@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mars
+{
+
+/*!
+ * \brief A collection of names that are stored in one contiguous character array.
+ *
+ * \details
+ * The characters of all names are concatenated and an array of `size() + 1` offsets marks where each name starts.
+ * The pool either owns its arrays or refers to arrays in external memory, e.g. a mapped index file, which is kept
+ * alive by the pool. In the latter case, only the memory pages of names that are actually accessed are loaded.
+ */
+class NamePool
+{
+private:
+    //! \brief The owned offsets of the names, followed by the total length.
+    std::vector<uint64_t> own_offsets;
+
+    //! \brief The owned characters of the names.
+    std::string own_chars;
+
+    //! \brief Keeps the external memory alive; if set, the pool refers to the external arrays below.
+    std::shared_ptr<void const> storage;
+
+    //! \brief The external offsets of the names, followed by the total length.
+    uint64_t const * ext_offsets;
+
+    //! \brief The external characters of the names.
+    char const * ext_chars;
+
+    //! \brief The number of names in external memory.
+    size_t ext_count;
+
+    //! \brief The offsets, either owned or external.
+    [[nodiscard]] uint64_t const * offsets() const noexcept
+    {
+        return storage ? ext_offsets : own_offsets.data();
+    }
+
+    //! \brief The characters, either owned or external.
+    [[nodiscard]] char const * chars() const noexcept
+    {
+        return storage ? ext_chars : own_chars.data();
+    }
+
+public:
+    //! \brief Construct an empty pool.
+    NamePool() : own_offsets{0u}, own_chars{}, storage{}, ext_offsets{nullptr}, ext_chars{nullptr}, ext_count{0} {}
+
+    /*!
+     * \brief Construct a pool that refers to external memory.
+     * \param offsets The `count + 1` offsets of the names.
+     * \param chars The characters of the names.
+     * \param count The number of names.
+     * \param storage The owner of the external memory, which is kept alive as long as the pool refers to it.
+     */
+    NamePool(uint64_t const * offsets, char const * chars, size_t count, std::shared_ptr<void const> storage) :
+        own_offsets{0u},
+        own_chars{},
+        storage{std::move(storage)},
+        ext_offsets{offsets},
+        ext_chars{chars},
+        ext_count{count}
+    {}
+
+    //! \brief The number of names in the pool.
+    [[nodiscard]] size_t size() const noexcept
+    {
+        return storage ? ext_count : own_offsets.size() - 1;
+    }
+
+    //! \brief Whether the pool contains no names.
+    [[nodiscard]] bool empty() const noexcept
+    {
+        return size() == 0;
+    }
+
+    //! \brief The total number of characters of all names.
+    [[nodiscard]] uint64_t num_chars() const noexcept
+    {
+        return offsets()[size()];
+    }
+
+    /*!
+     * \brief Access a name.
+     * \param idx The position of the name.
+     * \return a view of the name, which is valid as long as the pool is not modified.
+     */
+    [[nodiscard]] std::string_view operator[](size_t idx) const
+    {
+        uint64_t const * off = offsets();
+        return std::string_view{chars() + off[idx], off[idx + 1] - off[idx]};
+    }
+
+    //! \brief The `size() + 1` offsets of the names.
+    [[nodiscard]] uint64_t const * offset_data() const noexcept
+    {
+        return offsets();
+    }
+
+    //! \brief The concatenated characters of the names.
+    [[nodiscard]] char const * char_data() const noexcept
+    {
+        return chars();
+    }
+
+    /*!
+     * \brief Append a name to the pool.
+     * \param name The name.
+     *
+     * \details
+     * If the pool refers to external memory, its names are copied into owned memory first.
+     */
+    void push_back(std::string_view name)
+    {
+        if (storage)
+        {
+            own_offsets.assign(ext_offsets, ext_offsets + ext_count + 1);
+            own_chars.assign(ext_chars, ext_offsets[ext_count]);
+            storage.reset();
+        }
+        own_chars.append(name);
+        own_offsets.push_back(own_chars.size());
+    }
+
+    //! \brief Remove all names from the pool.
+    void clear()
+    {
+        own_offsets.assign(1, 0u);
+        own_chars.clear();
+        storage.reset();
+    }
+
+    //! \brief Reserve memory for the given number of names and characters.
+    void reserve(size_t count, size_t characters)
+    {
+        own_offsets.reserve(count + 1);
+        own_chars.reserve(characters);
+    }
+};
+
+} // namespace mars
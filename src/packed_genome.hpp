@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <seqan3/std/ranges>
+#include <vector>
+
+#include <seqan3/alphabet/nucleotide/dna4.hpp>
+
+namespace mars
+{
+
+/*!
+ * \brief A collection of DNA sequences that stores each nucleotide in 2 bits.
+ *
+ * \details
+ * The sequences are concatenated without delimiters and packed into 64-bit words.
+ * The start position of each sequence within the concatenation is stored separately.
+ * The genome either owns its arrays or refers to arrays in external memory, e.g. a mapped index file,
+ * which is kept alive by the genome.
+ */
+class PackedGenome
+{
+private:
+    //! \brief The number of nucleotides that fit into a word.
+    static constexpr uint64_t per_word{32};
+
+    //! \brief The packed nucleotides.
+    std::vector<uint64_t> words;
+
+    //! \brief The start positions of the sequences, followed by the total length.
+    std::vector<uint64_t> starts;
+
+    //! \brief Keeps the external memory alive; if set, the genome refers to the external arrays below.
+    std::shared_ptr<void const> storage;
+
+    //! \brief The external packed nucleotides.
+    uint64_t const * ext_words;
+
+    //! \brief The external start positions, followed by the total length.
+    uint64_t const * ext_starts;
+
+    //! \brief The number of sequences in external memory.
+    size_t ext_count;
+
+    //! \brief The packed nucleotides, either owned or external.
+    [[nodiscard]] uint64_t const * word_ptr() const noexcept
+    {
+        return storage ? ext_words : words.data();
+    }
+
+    //! \brief The start positions, either owned or external.
+    [[nodiscard]] uint64_t const * start_ptr() const noexcept
+    {
+        return storage ? ext_starts : starts.data();
+    }
+
+public:
+    //! \brief Copy the external arrays into owned memory, such that the genome can be modified and the
+    //!        external memory can be released.
+    void make_owned()
+    {
+        if (!storage)
+            return;
+        words.assign(ext_words, ext_words + number_of_words());
+        starts.assign(ext_starts, ext_starts + ext_count + 1);
+        storage.reset();
+    }
+
+    //! \brief Construct an empty genome.
+    PackedGenome() : words{}, starts{0u}, storage{}, ext_words{nullptr}, ext_starts{nullptr}, ext_count{0} {}
+
+    /*!
+     * \brief Construct a genome that refers to external memory.
+     * \param start_array The `count + 1` start positions of the sequences, where the last one is the total length.
+     * \param word_array The packed nucleotides.
+     * \param count The number of sequences.
+     * \param storage The owner of the external memory, which is kept alive as long as the genome refers to it.
+     */
+    PackedGenome(uint64_t const * start_array,
+                 uint64_t const * word_array,
+                 size_t count,
+                 std::shared_ptr<void const> storage) :
+        words{},
+        starts{0u},
+        storage{std::move(storage)},
+        ext_words{word_array},
+        ext_starts{start_array},
+        ext_count{count}
+    {}
+
+    /*!
+     * \brief Append a sequence to the genome.
+     * \tparam seq_t The type of the sequence; its elements must be convertible to seqan3::dna4.
+     * \param seq The sequence.
+     */
+    template <std::ranges::input_range seq_t>
+    void append(seq_t && seq)
+    {
+        make_owned();
+        uint64_t length = starts.back();
+        for (seqan3::dna4 const nt : seq)
+        {
+            if (length % per_word == 0)
+                words.push_back(0u);
+            words.back() |= static_cast<uint64_t>(seqan3::to_rank(nt)) << (2 * (length % per_word));
+            ++length;
+        }
+        starts.push_back(length);
+    }
+
+    /*!
+     * \brief Access a nucleotide.
+     * \param pos The position in the concatenation of all sequences.
+     * \return the nucleotide at the given position.
+     */
+    [[nodiscard]] seqan3::dna4 at(uint64_t pos) const
+    {
+        return seqan3::dna4{}.assign_rank((word_ptr()[pos / per_word] >> (2 * (pos % per_word))) & 3u);
+    }
+
+    //! \brief The number of sequences in the genome.
+    [[nodiscard]] size_t number_of_seq() const
+    {
+        return storage ? ext_count : starts.size() - 1;
+    }
+
+    //! \brief The length of the sequence with the given index.
+    [[nodiscard]] uint64_t seq_length(size_t idx) const
+    {
+        return start_ptr()[idx + 1] - start_ptr()[idx];
+    }
+
+    //! \brief The total number of nucleotides in the genome.
+    [[nodiscard]] uint64_t total_length() const
+    {
+        return start_ptr()[number_of_seq()];
+    }
+
+    //! \brief The start position of the sequence with the given index in the concatenation of all sequences.
+    [[nodiscard]] uint64_t seq_start(size_t idx) const
+    {
+        return start_ptr()[idx];
+    }
+
+    //! \brief The number of words that store the packed nucleotides.
+    [[nodiscard]] size_t number_of_words() const
+    {
+        return (total_length() + per_word - 1) / per_word;
+    }
+
+    //! \brief The packed nucleotides, where position `i` is stored in bits `2 * (i % 32)` of word `i / 32`.
+    [[nodiscard]] uint64_t const * word_data() const
+    {
+        return word_ptr();
+    }
+
+    //! \brief The `number_of_seq() + 1` start positions of the sequences, where the last one is the total length.
+    [[nodiscard]] uint64_t const * start_data() const
+    {
+        return start_ptr();
+    }
+
+    //! \brief The number of bytes occupied by the genome.
+    [[nodiscard]] size_t memory_usage() const
+    {
+        return (words.capacity() + starts.capacity()) * sizeof(uint64_t);
+    }
+
+    //! \brief A 64-bit checksum of the packed sequences and their lengths.
+    [[nodiscard]] uint64_t checksum() const
+    {
+        uint64_t hash{14695981039346656037ull};
+        auto mix = [&hash] (uint64_t value)
+        {
+            hash = (hash ^ value) * 1099511628211ull;
+            hash ^= hash >> 32;
+        };
+        for (size_t idx = 0; idx < number_of_words(); ++idx)
+            mix(word_ptr()[idx]);
+        for (size_t idx = 0; idx <= number_of_seq(); ++idx)
+            mix(start_ptr()[idx]);
+        return hash;
+    }
+
+    /*!
+     * \brief A random-access view on a sequence of the genome.
+     * \param idx The index of the sequence.
+     * \return a view of seqan3::dna4 characters.
+     */
+    [[nodiscard]] auto sequence(size_t idx) const
+    {
+        return std::ranges::views::iota(start_ptr()[idx], start_ptr()[idx + 1])
+             | std::ranges::views::transform([this] (uint64_t pos) { return at(pos); });
+    }
+
+    /*!
+     * \brief A view on a range of consecutive sequences, which can be used as a text collection.
+     * \param first The index of the first sequence.
+     * \param last The index behind the last sequence.
+     * \return a view of sequence views.
+     */
+    [[nodiscard]] auto sequences(size_t first, size_t last) const
+    {
+        return std::ranges::views::iota(first, last)
+             | std::ranges::views::transform([this] (size_t idx) { return sequence(idx); });
+    }
+
+    //! \brief A view on all sequences of the genome, which can be used as a text collection.
+    [[nodiscard]] auto sequences() const
+    {
+        return sequences(0u, number_of_seq());
+    }
+};
+
+} // namespace mars
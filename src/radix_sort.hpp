@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace mars
+{
+
+/*!
+ * \brief Sort records by a 64-bit key with a stable, parallel least-significant-digit radix sort.
+ * \tparam record_t The type of the records, which must be copyable.
+ * \tparam key_fn_t The type of the key function.
+ * \param records The records to be sorted.
+ * \param key A function that returns the 64-bit key of a record.
+ * \param threads The maximum number of threads.
+ *
+ * \details
+ * The keys are sorted byte by byte, starting at the least significant one. Each thread counts and scatters a
+ * contiguous chunk of the records, such that the result is stable and independent of the number of threads.
+ * Passes over bytes that are equal in all keys are skipped, which is common for the most significant bytes.
+ */
+template <typename record_t, typename key_fn_t>
+void radix_sort(std::vector<record_t> & records, key_fn_t && key, unsigned int threads = 1u)
+{
+    size_t const size = records.size();
+    if (size < 2)
+        return;
+
+    // Small inputs are not worth the overhead of splitting.
+    size_t const min_chunk{1u << 16};
+    size_t const num_chunks = std::clamp<size_t>(size / min_chunk, 1u, std::max(threads, 1u));
+    auto chunk_begin = [size, num_chunks] (size_t chunk) { return size * chunk / num_chunks; };
+
+    std::vector<record_t> buffer(size);
+    std::vector<std::array<size_t, 256>> counts(num_chunks);
+    for (unsigned int shift = 0; shift < 64; shift += 8)
+    {
+        #pragma omp parallel for num_threads(num_chunks) schedule(static, 1)
+        for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+        {
+            counts[chunk].fill(0u);
+            for (size_t idx = chunk_begin(chunk); idx < chunk_begin(chunk + 1); ++idx)
+                ++counts[chunk][(key(records[idx]) >> shift) & 0xFFu];
+        }
+
+        // Convert the counts into the output positions of each chunk and bucket.
+        size_t position = 0;
+        bool skip = false;
+        for (size_t bucket = 0; bucket < 256; ++bucket)
+        {
+            size_t const bucket_begin = position;
+            for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+            {
+                size_t const count = counts[chunk][bucket];
+                counts[chunk][bucket] = position;
+                position += count;
+            }
+            skip = skip || position - bucket_begin == size;
+        }
+        if (skip)
+            continue;
+
+        #pragma omp parallel for num_threads(num_chunks) schedule(static, 1)
+        for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+            for (size_t idx = chunk_begin(chunk); idx < chunk_begin(chunk + 1); ++idx)
+                buffer[counts[chunk][(key(records[idx]) >> shift) & 0xFFu]++] = records[idx];
+        records.swap(buffer);
+    }
+}
+
+} // namespace mars
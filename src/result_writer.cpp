@@ -0,0 +1,89 @@
+#include <cstdio>
+#include <type_traits>
+
+#include <seqan3/std/charconv>
+
+#include "result_writer.hpp"
+
+namespace mars
+{
+
+// The column width of the sequence names.
+size_t constexpr name_width{35};
+
+template <typename number_t>
+void ResultWriter::append_number(number_t number)
+{
+    char digits[32];
+    if constexpr (std::is_floating_point_v<number_t>)
+    {
+        // The default stream format of floating point numbers, i.e. 6 significant digits.
+        int const length = std::snprintf(digits, sizeof(digits), "%g", static_cast<double>(number));
+        buffer.append(digits, length);
+    }
+    else
+    {
+        auto const result = std::to_chars(digits, digits + sizeof(digits), number);
+        buffer.append(digits, result.ptr);
+    }
+}
+
+ResultWriter::ResultWriter(std::ostream & out, bool strand_column, size_t capacity) :
+    out{out},
+    buffer{},
+    capacity{capacity},
+    strand_column{strand_column}
+{
+    buffer.reserve(capacity + 256);
+}
+
+ResultWriter::~ResultWriter()
+{
+    flush();
+}
+
+void ResultWriter::write_header()
+{
+    std::string_view const name{"sequence name"};
+    buffer += ' ';
+    buffer += name;
+    buffer.append(name_width - name.size(), ' ');
+    buffer += strand_column ? "\tindex\tpos\tstrand\tn\tscore\n" : "\tindex\tpos\tn\tscore\n";
+}
+
+void ResultWriter::write(std::string_view name, MotifLocation const & location)
+{
+    buffer += '>';
+    buffer += name;
+    if (name.size() < name_width)
+        buffer.append(name_width - name.size(), ' ');
+    buffer += '\t';
+    append_number(location.sequence);
+    buffer += '\t';
+    append_number(location.position);
+    buffer += '\t';
+    if (strand_column)
+    {
+        buffer += location.reverse ? '-' : '+';
+        buffer += '\t';
+    }
+    append_number(+location.num_stemloops);
+    buffer += '\t';
+    append_number(location.score);
+    buffer += '\n';
+
+    if (buffer.size() >= capacity)
+    {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+}
+
+void ResultWriter::flush()
+{
+    out.write(buffer.data(), buffer.size());
+    buffer.clear();
+    out.flush();
+}
+
+} // namespace mars
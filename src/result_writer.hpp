@@ -0,0 +1,65 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include "search.hpp"
+
+namespace mars
+{
+
+/*!
+ * \brief Formats motif locations into a large buffer and writes it to the output stream in big blocks.
+ *
+ * \details
+ * The lines are identical to the formatted stream output, but the stream is not flushed per line.
+ * The remaining buffer is written when the writer is flushed or destroyed. The strand column is only written
+ * when both strands are searched, such that the output of a forward search keeps its format.
+ */
+class ResultWriter
+{
+private:
+    //! \brief The output stream.
+    std::ostream & out;
+
+    //! \brief The formatted lines that have not been written yet.
+    std::string buffer;
+
+    //! \brief The buffer size at which the buffer is written to the stream.
+    size_t const capacity;
+
+    //! \brief Whether the strand of the locations is written.
+    bool const strand_column;
+
+    //! \brief Append a number to the buffer.
+    template <typename number_t>
+    void append_number(number_t number);
+
+public:
+    /*!
+     * \brief Construct a writer.
+     * \param out The output stream.
+     * \param strand_column Whether the strand of the locations is written, i.e. both strands are searched.
+     * \param capacity The buffer size in bytes at which the buffer is written to the stream.
+     */
+    explicit ResultWriter(std::ostream & out, bool strand_column = false, size_t capacity = 1u << 20);
+
+    //! \brief Write the remaining buffer.
+    ~ResultWriter();
+
+    //! \brief Append the column header.
+    void write_header();
+
+    /*!
+     * \brief Append the line of a motif location.
+     * \param name The name of the sequence.
+     * \param location The motif location.
+     */
+    void write(std::string_view name, MotifLocation const & location);
+
+    //! \brief Write the buffer to the stream and flush it.
+    void flush();
+};
+
+} // namespace mars
@@ -1,9 +1,15 @@
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <optional>
+
 #include <seqan3/range/views/zip.hpp>
 
 #ifdef MARS_WITH_OPENMP
     #include <omp.h>
 #endif
 
+#include "radix_sort.hpp"
 #include "search.hpp"
 #include "settings.hpp"
 
@@ -11,155 +17,530 @@ namespace mars
 {
 
 template <seqan3::semialphabet Alphabet>
-inline std::set<std::pair<MotifScore, Alphabet>> SearchGenerator::priority(profile_char<Alphabet> const & prof) const
+CandidateList<Alphabet> SearchGenerator::priority(profile_char<Alphabet> const & prof) const
 {
-    std::set<std::pair<MotifScore, Alphabet>> result{};
+    CandidateList<Alphabet> result{};
 
     auto const & quantities = prof.log_quantities();
     auto const & bg = background_distr.get<seqan3::alphabet_size<Alphabet>>();
 
     for (auto && [idx, score, bg] : seqan3::views::zip(std::ranges::views::iota(0), quantities, bg))
         if (score - bg - log_depth >= -2.f)
-            result.emplace(score - bg - log_depth, Alphabet{}.assign_rank(idx));
+            result.items[result.size++] = {score - bg - log_depth, Alphabet{}.assign_rank(idx)};
 
-    return std::move(result);
+    // the best candidates are tried first
+    std::sort(result.items.begin(), result.items.begin() + result.size, std::greater<>{});
+    return result;
 }
 
-template <typename MotifElement>
-void SearchGenerator::recurse_search(StemloopMotif const & motif, ElementIter const & elem_it, MotifLen idx)
+SearchProgram SearchGenerator::compile(StemloopMotif const & motif) const
 {
-    if (bds.xdrop())
-        return;
+    // The profiles are fixed after the motif analysis, so the candidates of each column are computed only once.
+    SearchProgram program{};
+    program.motif = &motif;
 
-    auto const & elem = std::get<MotifElement>(*elem_it);
+    // The columns of an element are visited from the inside to the outside of the stem loop.
+    // A gap skips columns of the element and may end behind it, i.e. at the first step of the next element.
+    auto add_steps = [this, &program] (auto const & elem, StepKind kind, auto & candidates)
+    {
+        uint32_t const first_step = program.steps.size();
+        for (size_t idx = 0; idx < elem.profile.size(); ++idx)
+        {
+            SearchStep step{kind, static_cast<uint32_t>(candidates.size()), 0u, 0u, 0.f, false};
+            candidates.push_back(priority(elem.profile[elem.profile.size() - idx - 1]));
+            step.gaps_begin = program.gap_targets.size();
+            for (auto && [len, num] : elem.gaps[elem.gaps.size() - idx - 1])
+                program.gap_targets.push_back(first_step + idx + len);
+            step.gaps_end = program.gap_targets.size();
+            program.steps.push_back(step);
+        }
+    };
 
-    if (idx == elem.profile.size())
+    // start with the hairpin
+    for (auto element = motif.elements.crbegin(); element != motif.elements.crend(); ++element)
     {
-        auto const next = elem_it + 1;
-        if (next == motif.elements.crend())
-            bds.compute_hits(hits, motif);
-        else if (std::holds_alternative<StemElement>(*next))
-            recurse_search<StemElement>(motif, next, 0);
+        if (std::holds_alternative<LoopElement>(*element))
+        {
+            LoopElement const & loop = std::get<LoopElement>(*element);
+            add_steps(loop, loop.is_5prime ? StepKind::loop_left : StepKind::loop_right, program.loop_candidates);
+        }
         else
-            recurse_search<LoopElement>(motif, next, 0);
+        {
+            add_steps(std::get<StemElement>(*element), StepKind::stem, program.stem_candidates);
+        }
+    }
+    program.steps.push_back(SearchStep{StepKind::report, 0u, 0u, 0u, 0.f, false});
+    for (uint32_t target : program.gap_targets)
+        program.steps[target].gap_target = true;
+
+    // Compute the score bounds backwards: a step either adds its best candidate or skips to a gap target.
+    // A bound of -infinity means that the report step cannot be reached.
+    uint32_t const num_steps = program.steps.size();
+    for (uint32_t idx = num_steps - 1; idx-- > 0;)
+    {
+        SearchStep & step = program.steps[idx];
+        step.best_remaining = -std::numeric_limits<float>::infinity();
+        if (step.kind == StepKind::stem && program.stem_candidates[step.candidates].size > 0)
+            step.best_remaining = program.stem_candidates[step.candidates].items[0].first;
+        else if (step.kind != StepKind::stem && program.loop_candidates[step.candidates].size > 0)
+            step.best_remaining = program.loop_candidates[step.candidates].items[0].first;
+        step.best_remaining += program.steps[idx + 1].best_remaining;
+        for (uint32_t gap = step.gaps_begin; gap < step.gaps_end; ++gap)
+        {
+            SearchStep const & target = program.steps[program.gap_targets[gap]];
+            step.best_remaining = std::max(step.best_remaining, target.best_remaining);
+        }
+    }
+    return program;
+}
+
+// private helper function for find_motifs
+SearchProgram reverse_complement(SearchProgram const & program)
+{
+    // The search visits the same columns, but extends to the other side with the complementary characters.
+    // A base pair (5' base, 3' base) of the motif appears as (complement of 3' base, complement of 5' base).
+    SearchProgram result{program};
+    result.reverse = !program.reverse;
+    for (SearchStep & step : result.steps)
+    {
+        if (step.kind == StepKind::loop_left)
+            step.kind = StepKind::loop_right;
+        else if (step.kind == StepKind::loop_right)
+            step.kind = StepKind::loop_left;
+    }
+    for (CandidateList<seqan3::rna4> & list : result.loop_candidates)
+    {
+        for (auto & item : list.items)
+            item.second = seqan3::complement(item.second);
+        std::sort(list.items.begin(), list.items.begin() + list.size, std::greater<>{});
+    }
+    for (CandidateList<bi_alphabet<seqan3::rna4>> & list : result.stem_candidates)
+    {
+        for (auto & item : list.items)
+            item.second = bi_alphabet<seqan3::rna4>{seqan3::complement(get<1>(item.second)),
+                                                    seqan3::complement(get<0>(item.second))};
+        std::sort(list.items.begin(), list.items.begin() + list.size, std::greater<>{});
+    }
+    return result;
+}
+
+TranspositionTable::Entry * TranspositionTable::find(uint32_t step, BiDirectionalSearch const & bds)
+{
+    auto [first, last] = entries.equal_range(key(step, bds));
+    for (auto it = first; it != last; ++it)
+        if (it->second.step == step && it->second.cursor == bds.cursor())
+            return &it->second;
+    return nullptr;
+}
+
+bool TranspositionTable::dominated(uint32_t step, BiDirectionalSearch const & bds)
+{
+    Entry const * entry = find(step, bds);
+    if (entry == nullptr || bds.score() > entry->score)
+        return false;
+    for (size_t back = 1; back <= window; ++back)
+        if (bds.previous_score(back) < histories[entry->history + back - 1])
+            return false;
+    return true;
+}
+
+void TranspositionTable::insert(uint32_t step, BiDirectionalSearch const & bds)
+{
+    // An existing entry is replaced, because the new state has been explored completely as well.
+    Entry * entry = find(step, bds);
+    if (entry == nullptr)
+    {
+        if (entries.size() >= max_entries)
+            return;
+        entry = &entries.emplace(key(step, bds), Entry{step, bds.cursor(), 0.f, histories.size()})->second;
+        histories.resize(histories.size() + window);
+    }
+    entry->score = bds.score();
+    for (size_t back = 1; back <= window; ++back)
+        histories[entry->history + back - 1] = bds.previous_score(back);
+}
+
+void SearchGenerator::descend(BiDirectionalSearch & bds,
+                              LeafList & leaves,
+                              TranspositionTable & table,
+                              LeafList * subtree_leaves,
+                              SearchProgram const & program,
+                              uint32_t step_idx,
+                              unsigned int depth) const
+{
+    if (subtree_leaves == nullptr)
+    {
+        run_program(bds, leaves, table, program, step_idx, depth);
         return;
     }
 
-    auto prio = priority(elem.profile[elem.profile.size() - idx - 1]);
+    // The subtree becomes a task that an idle thread can take over, with a copy of the current search state
+    // and a table of its own.
+    BiDirectionalSearch subtree_bds{bds};
+    #pragma omp task shared(program) firstprivate(subtree_bds, subtree_leaves, step_idx, depth)
+    {
+        TranspositionTable subtree_table{xdrop};
+        run_program(subtree_bds, *subtree_leaves, subtree_table, program, step_idx, depth);
+    }
+}
+
+void SearchGenerator::run_program(BiDirectionalSearch & bds,
+                                  LeafList & leaves,
+                                  TranspositionTable & table,
+                                  SearchProgram const & program,
+                                  uint32_t step_idx,
+                                  unsigned int depth) const
+{
+    SearchStep const & step = program.steps[step_idx];
 
-    // try to extend the pattern
-    for (auto opt = prio.crbegin(); opt != prio.crend(); ++opt)
+    // Stop if the score dropped, or if the remaining steps cannot reach the minimum score.
+    if (bds.xdrop() || bds.score() + step.best_remaining < min_score)
+        return;
+
+    if (step.kind == StepKind::report)
+    {
+        bds.record_leaf(leaves);
+        return;
+    }
+
+    // Different gap paths can reach this step with the same query, whose subtree needs to be searched only once.
+    if (step.gap_target && table.dominated(step_idx, bds))
+        return;
+
+    uint8_t const num_candidates = step.kind == StepKind::stem ? program.stem_candidates[step.candidates].size
+                                                               : program.loop_candidates[step.candidates].size;
+
+    // Near the root, the subtrees are searched as separate tasks. They collect their leaves separately,
+    // which are appended in a fixed order afterwards.
+    bool const split = depth < split_depth;
+    std::vector<LeafList> subtree_leaves(split ? num_candidates + step.gaps_end - step.gaps_begin : 0u);
+    auto subtree = subtree_leaves.begin();
+    auto next_subtree = [split, &subtree] () { return split ? &*subtree++ : nullptr; };
+
+    // The extensions of a loop step are computed together before descending into them.
+    // A stem step extends to the left once per distinct 5' base, which all pairs with that base share.
+    bool const left = step.kind != StepKind::loop_right;
+    if (num_candidates > 0)
     {
-        bool succ;
-        if constexpr (std::is_same_v<MotifElement, LoopElement>)
-            succ = bds.append_loop(*opt, elem.is_5prime);
+        uint8_t wanted = 0;
+        if (step.kind == StepKind::stem)
+        {
+            using seqan3::get;
+            for (auto const & item : program.stem_candidates[step.candidates])
+                wanted |= 1u << get<0>(item.second).to_rank();
+        }
         else
-            succ = bds.append_stem(*opt);
+        {
+            for (auto const & item : program.loop_candidates[step.candidates])
+                wanted |= 1u << item.second.to_rank();
+        }
+        bds.compute_loop_children(wanted, left);
+    }
+
+    // try to extend the pattern
+    for (uint8_t cand = 0; cand < num_candidates; ++cand)
+    {
+        bool const succ = step.kind == StepKind::stem
+                        ? bds.append_stem_child(program.stem_candidates[step.candidates].items[cand])
+                        : bds.append_child(program.loop_candidates[step.candidates].items[cand], left);
 
         if (succ)
         {
-            recurse_search<MotifElement>(motif, elem_it, idx + 1);
+            descend(bds, leaves, table, next_subtree(), program, step_idx + 1, depth + 1);
             bds.backtrack();
         }
     }
 
     // try gaps
-    for (auto && [len, num] : elem.gaps[elem.gaps.size() - idx - 1])
-        recurse_search<MotifElement>(motif, elem_it, idx + len);
+    for (uint32_t gap = step.gaps_begin; gap < step.gaps_end; ++gap)
+        descend(bds, leaves, table, next_subtree(), program, program.gap_targets[gap], depth + 1);
+
+    if (split)
+    {
+        #pragma omp taskwait
+        for (LeafList & list : subtree_leaves)
+            std::move(list.begin(), list.end(), std::back_inserter(leaves));
+    }
+
+    if (step.gap_target)
+        table.insert(step_idx, bds);
+}
+
+// private helper function for keeping only the best max_hits locations, the worst one is at the heap front
+void add_location(std::vector<MotifLocation> & results, MotifLocation && location, size_t max_hits)
+{
+    if (max_hits == 0u || results.size() < max_hits)
+    {
+        results.push_back(std::move(location));
+        if (max_hits != 0u)
+            std::push_heap(results.begin(), results.end(), MotifLocationCompare{});
+    }
+    else if (MotifLocationCompare{}(location, results.front()))
+    {
+        std::pop_heap(results.begin(), results.end(), MotifLocationCompare{});
+        results.back() = std::move(location);
+        std::push_heap(results.begin(), results.end(), MotifLocationCompare{});
+    }
 }
 
-void SearchGenerator::find_motifs(std::vector<StemloopMotif> const & motifs)
+void SearchGenerator::cluster_hits(std::vector<HitRecord>::const_iterator seq_begin,
+                                   std::vector<HitRecord>::const_iterator seq_end,
+                                   std::vector<float> & max_score,
+                                   std::vector<Hit> & selection,
+                                   std::vector<MotifLocation> & results) const
+{
+    size_t const sidx = encoding.seq(seq_begin->key);
+    auto left_end = seq_begin;
+    auto right_end = left_end;
+    do
+    {
+        std::fill(max_score.begin(), max_score.end(), 0.f);
+        selection.clear();
+        size_t const left_pos = encoding.pos(left_end->key);
+        while (right_end != seq_end && encoding.pos(right_end->key) <= left_pos + 30)
+        {
+            selection.emplace_back(encoding.pos(right_end->key),
+                                   encoding.midx(right_end->key),
+                                   encoding.score(right_end->key));
+            ++right_end;
+        }
+        std::sort(selection.begin(), selection.end(), [] (Hit const & a, Hit const & b)
+        {
+            if (a.midx != b.midx)
+                return a.midx < b.midx;
+            return a.score > b.score;
+        });
+        long long base_pos = static_cast<long long>(selection.begin()->pos);
+        for (Hit & hit : selection)
+        {
+            int pos_diff = static_cast<int>(hit.pos - base_pos);
+            hit.score = static_cast<float>(std::max(0.0, hit.score - (0.05 * pos_diff * pos_diff)));
+            max_score[hit.midx] = std::max(max_score[hit.midx], hit.score);
+        }
+
+        uint8_t diversity = 0; // number of different motifs found
+        float hit_score = 0;
+        for (float score : max_score)
+        {
+            diversity += score > 0.f ? 1 : 0;
+            hit_score += score;
+        }
+
+        base_pos -= static_cast<long long>(max_offset);
+
+        // The windows of the reverse strand are mirrored, their start is reported in forward coordinates.
+        bool const reverse = encoding.reverse(seq_begin->key);
+        if (reverse)
+            base_pos = static_cast<long long>(encoding.mirror(static_cast<size_t>(base_pos)));
+
+        if (diversity > 1 && hit_score >= min_hit_score)
+            add_location(results, MotifLocation{hit_score, diversity, base_pos, sidx, reverse}, max_hits);
+
+        left_end = right_end;
+    } while (right_end != seq_end);
+}
+
+void SearchGenerator::find_motifs(std::vector<StemloopMotif> const & motifs, LocationCallback const & report)
 {
     if (mars::verbose > 0)
         std::cerr << "Start the motif search...";
     assert(motifs.size() <= UINT8_MAX);
     uint8_t const num_motifs = motifs.size();
-    hits.resize(bds.number_of_seq());
+    hits.clear();
 
+    max_offset = 0;
     for (auto const & motif : motifs)
-        bds.update_max_offset(motif.bounds.first);
+        max_offset = std::max<size_t>(max_offset, motif.bounds.first);
+
+    // The size of a shard bounds the length of its sequences, which determines the width of the hit positions.
+    size_t max_length = 1u;
+    for (size_t idx = 0; idx < index.number_of_shards(); ++idx)
+        max_length = std::max<size_t>(max_length, index.shard(idx).index.size());
+    encoding = HitEncoding{index.number_of_seq(), max_length, max_offset, num_motifs};
 
-//    #pragma omp parallel for num_threads(2)
-    for (uint8_t midx = 0; midx < num_motifs; ++midx)
+    // Lower the motifs into search programs. The search stacks are preallocated for the longest program.
+    // The reverse strand is searched with the reverse complement of each program in the same index.
+    size_t const num_programs = both_strands ? 2u * num_motifs : num_motifs;
+    std::vector<SearchProgram> programs(num_programs);
+    #pragma omp parallel for num_threads(threads)
+    for (size_t midx = 0; midx < num_motifs; ++midx)
     {
-        auto const & motif = motifs[midx];
-        // start with the hairpin
-        auto const iter = motif.elements.crbegin();
-        recurse_search<LoopElement>(motif, iter, 0);
-        if (verbose > 0)
-            std::cerr << "  " << (100*(midx+1)/num_motifs) << "%";
+        programs[midx] = compile(motifs[midx]);
+        if (both_strands)
+            programs[num_motifs + midx] = reverse_complement(programs[midx]);
+    }
+    size_t max_steps = 0;
+    for (SearchProgram const & program : programs)
+        max_steps = std::max(max_steps, program.steps.size());
+
+    // Each pair of program and shard is an independent task with its own search state and leaf list.
+    // The tasks split further into subtree tasks, which are distributed among the threads on demand.
+    // Every thread keeps one search state, whose stacks are reused by all tasks that it runs. The tasks are tied,
+    // so a thread that waits for subtree tasks never starts another of these tasks, which are no descendants.
+    size_t const num_tasks = index.number_of_shards() * num_programs;
+    std::vector<LeafList> task_leaves(num_tasks);
+    std::vector<std::optional<BiDirectionalSearch>> thread_searches(std::max(threads, 1u));
+    size_t tasks_done = 0;
+    #pragma omp parallel num_threads(threads)
+    #pragma omp single
+    for (size_t task = 0; task < num_tasks; ++task)
+    {
+        #pragma omp task firstprivate(task) shared(programs, task_leaves, thread_searches, tasks_done, max_steps)
+        {
+#ifdef MARS_WITH_OPENMP
+            std::optional<BiDirectionalSearch> & bds = thread_searches[omp_get_thread_num()];
+#else
+            std::optional<BiDirectionalSearch> & bds = thread_searches.front();
+#endif
+            if (bds)
+                bds->reset(index.shard(task / num_programs));
+            else
+                bds.emplace(index.shard(task / num_programs), xdrop, max_steps);
+            TranspositionTable table{xdrop};
+            run_program(*bds, task_leaves[task], table, programs[task % num_programs], 0u, 0u);
+            // Different search paths often end in the same interval, which needs to be located only once.
+            merge_leaves(task_leaves[task]);
+            if (verbose > 0)
+            {
+                #pragma omp critical
+                std::cerr << "  " << (100 * ++tasks_done / num_tasks) << "%";
+            }
+        }
     }
     if (verbose > 0)
         std::cerr << std::endl;
 
-    #pragma omp parallel for num_threads(4)
-    for (size_t sidx = 0u; sidx < bds.number_of_seq(); ++sidx)
-        std::sort(hits[sidx].begin(), hits[sidx].end(), [] (Hit const & a, Hit const & b)
+    // Locate all leaves in one parallel pass. The number of occurrences of each leaf is known in advance,
+    // such that every leaf writes to its own range of the hit list, which is ordered by task and leaf.
+    std::vector<size_t> first_leaf(num_tasks + 1, 0u);
+    for (size_t task = 0; task < num_tasks; ++task)
+        first_leaf[task + 1] = first_leaf[task] + task_leaves[task].size();
+    std::vector<size_t> first_hit(first_leaf.back() + 1, 0u);
+    for (size_t task = 0; task < num_tasks; ++task)
+    {
+        for (size_t leaf = 0; leaf < task_leaves[task].size(); ++leaf)
         {
-            if (a.pos != b.pos)
-                return a.pos < b.pos;
-            if (a.midx != b.midx)
-                return a.midx < b.midx;
-            return a.score < b.score;
-        });
+            size_t const pos = first_leaf[task] + leaf;
+            first_hit[pos + 1] = first_hit[pos] + task_leaves[task][leaf].cursor.count();
+        }
+    }
 
-    size_t num_results = 0;
-//    #pragma omp parallel for num_threads(4)
-    for (size_t sidx = 0u; sidx < bds.number_of_seq(); ++sidx)
+    hits.resize(first_hit.back());
+    #pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t leaf = 0; leaf < first_leaf.back(); ++leaf)
     {
-        std::vector<Hit> const & hitvec = hits[sidx];
-        if (hitvec.empty())
-            continue;
+        size_t const task = std::upper_bound(first_leaf.begin(), first_leaf.end(), leaf) - first_leaf.begin() - 1;
+        SearchProgram const & program = programs[task % num_programs];
+        locate_leaf(hits.data() + first_hit[leaf],
+                    task_leaves[task][leaf - first_leaf[task]],
+                    index.shard(task / num_programs).first_seq,
+                    *program.motif,
+                    max_offset,
+                    encoding,
+                    program.reverse);
+    }
+    task_leaves.clear();
 
-        auto left_end = hitvec.cbegin();
-        auto right_end = left_end;
+    // Group the hits by sequence and position. Equal positions are ordered by motif and score, which are part
+    // of the key, such that the order does not depend on the thread schedule. Nested leaves of a motif report the
+    // same hits, which are merged.
+    radix_sort(hits, [] (HitRecord const & hit) { return hit.key; }, threads);
+    merge_hits(hits);
 
-        do
+    // Find the hits of each sequence and strand, which are clustered independently.
+    auto strand_of = [this] (HitRecord const & hit)
+    {
+        return std::make_pair(encoding.seq(hit.key), encoding.reverse(hit.key));
+    };
+    std::vector<size_t> first_seq_hit{};
+    for (size_t idx = 0; idx < hits.size(); ++idx)
+        if (idx == 0 || strand_of(hits[idx]) != strand_of(hits[idx - 1]))
+            first_seq_hit.push_back(idx);
+    size_t const num_seq_runs = first_seq_hit.size();
+    first_seq_hit.push_back(hits.size());
+
+    unsigned int const num_threads = std::max(threads, 1u);
+    locations.clear();
+    if (report && max_hits == 0u)
+    {
+        // Stream the results of each sequence and strand in the order of the sequences, as soon as they are clustered.
+        size_t num_results = 0;
+        #pragma omp parallel num_threads(num_threads) reduction(+: num_results)
         {
-            std::vector<float> max_score(num_motifs, 0.f);
+            std::vector<float> max_score(num_motifs);
             std::vector<Hit> selection{};
-            while (right_end != hitvec.cend() && right_end->pos <= left_end->pos + 30)
-            {
-                selection.push_back(*right_end);
-                ++right_end;
-            }
-            std::sort(selection.begin(), selection.end(), [] (Hit const & a, Hit const & b)
-            {
-                if (a.midx != b.midx)
-                    return a.midx < b.midx;
-                return a.score > b.score;
-            });
-            long long base_pos = static_cast<long long>(selection.begin()->pos);
-            for (Hit & hit : selection)
-            {
-                int pos_diff = static_cast<int>(hit.pos - base_pos);
-                hit.score = static_cast<float>(std::max(0.0, hit.score - (0.05 * pos_diff * pos_diff)));
-                max_score[hit.midx] = std::max(max_score[hit.midx], hit.score);
-            }
-
-            uint8_t diversity = 0; // number of different motifs found
-            float hit_score = 0;
-            for (float score : max_score)
+            std::vector<MotifLocation> seq_locations{};
+            #pragma omp for ordered schedule(dynamic)
+            for (size_t run = 0; run < num_seq_runs; ++run)
             {
-                diversity += score > 0.f ? 1 : 0;
-                hit_score += score;
+                seq_locations.clear();
+                cluster_hits(hits.cbegin() + first_seq_hit[run],
+                             hits.cbegin() + first_seq_hit[run + 1],
+                             max_score,
+                             selection,
+                             seq_locations);
+                std::sort(seq_locations.begin(), seq_locations.end(), MotifLocationCompare{});
+                num_results += seq_locations.size();
+                #pragma omp ordered
+                {
+                    if (!seq_locations.empty())
+                        report(seq_locations);
+                }
             }
+        }
+        if (verbose > 1)
+            std::cerr << "Found " << num_results << " matches." << std::endl;
+        return;
+    }
 
-            base_pos -= static_cast<long long>(bds.get_max_offset());
+    // Each thread collects its results in a private buffer and sorts it, such that only a merge remains.
+    // With a limit, the buffers are bounded heaps and hold only the best results of their thread.
+    std::vector<std::vector<MotifLocation>> thread_locations(num_threads);
+    #pragma omp parallel num_threads(num_threads)
+    {
+#ifdef MARS_WITH_OPENMP
+        std::vector<MotifLocation> & local_locations = thread_locations[omp_get_thread_num()];
+#else
+        std::vector<MotifLocation> & local_locations = thread_locations.front();
+#endif
+        std::vector<float> max_score(num_motifs);
+        std::vector<Hit> selection{};
+        #pragma omp for schedule(dynamic)
+        for (size_t run = 0; run < num_seq_runs; ++run)
+            cluster_hits(hits.cbegin() + first_seq_hit[run],
+                         hits.cbegin() + first_seq_hit[run + 1],
+                         max_score,
+                         selection,
+                         local_locations);
+        std::sort(local_locations.begin(), local_locations.end(), MotifLocationCompare{});
+    }
 
-            if (diversity > 1)
-            {
-                locations.emplace(hit_score, diversity, base_pos, sidx);
-//                std::cout << ">" << std::left << std::setw(35) << bds.get_name(sidx) << "\t" << sidx << "\t"
-//                          << base_pos << "\t" << +diversity << "\t" << hit_score << std::endl;
-                ++num_results;
-            }
+    // Concatenate the sorted buffers and merge them pairwise. The order is total, thus independent of the schedule.
+    std::vector<size_t> run_bounds{0};
+    for (std::vector<MotifLocation> const & local_locations : thread_locations)
+        run_bounds.push_back(run_bounds.back() + local_locations.size());
+    locations.reserve(run_bounds.back());
+    for (std::vector<MotifLocation> & local_locations : thread_locations)
+        std::move(local_locations.begin(), local_locations.end(), std::back_inserter(locations));
+    thread_locations.clear();
 
-            left_end = right_end;
-        } while (right_end != hitvec.cend());
+    size_t const num_runs = num_threads;
+    for (size_t width = 1; width < num_runs; width *= 2)
+    {
+        #pragma omp parallel for num_threads(num_threads)
+        for (size_t run = 0; run < num_runs - width; run += 2 * width)
+            std::inplace_merge(locations.begin() + run_bounds[run],
+                               locations.begin() + run_bounds[run + width],
+                               locations.begin() + run_bounds[std::min(run + 2 * width, num_runs)],
+                               MotifLocationCompare{});
     }
+    if (max_hits != 0u && locations.size() > max_hits)
+        locations.erase(locations.begin() + max_hits, locations.end());
+    if (report)
+        report(locations);
+
     if (verbose > 1)
-        std::cerr << "Found " << num_results << " matches." << std::endl;
+        std::cerr << "Found " << locations.size() << " matches." << std::endl;
 }
 
 } // namespace mars
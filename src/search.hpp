@@ -3,8 +3,10 @@
 #include <array>
 #include <cmath>
 #include <cstdint>
-#include <set>
+#include <functional>
+#include <limits>
 #include <tuple>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
@@ -67,9 +69,10 @@ struct MotifLocation
     uint8_t num_stemloops;
     long long position;
     size_t sequence;
+    bool reverse;
 
-    MotifLocation(float s, uint8_t n, long long p, size_t i):
-        score{s}, num_stemloops{n}, position{p}, sequence{i}
+    MotifLocation(float s, uint8_t n, long long p, size_t i, bool r = false):
+        score{s}, num_stemloops{n}, position{p}, sequence{i}, reverse{r}
     {}
 };
 
@@ -82,39 +85,239 @@ struct MotifLocationCompare {
             return a.num_stemloops > b.num_stemloops;
         if (a.sequence != b.sequence)
             return a.sequence < b.sequence;
-        return a.position < b.position;
+        if (a.position != b.position)
+            return a.position < b.position;
+        return a.reverse < b.reverse;
     }
 };
 
-class SearchGenerator
+//! \brief Receives sorted motif locations, see SearchGenerator::find_motifs.
+using LocationCallback = std::function<void(std::vector<MotifLocation> const &)>;
+
+/*!
+ * \brief The characters of a profile column that are considered by the search, sorted by decreasing score.
+ * \tparam Alphabet The alphabet of the profile column.
+ */
+template <seqan3::semialphabet Alphabet>
+struct CandidateList
+{
+    //! \brief The score and character of each candidate; only the first `size` entries are valid.
+    std::array<std::pair<MotifScore, Alphabet>, seqan3::alphabet_size<Alphabet>> items{};
+
+    //! \brief The number of candidates.
+    uint8_t size{0};
+
+    //! \brief The first candidate.
+    auto begin() const
+    {
+        return items.cbegin();
+    }
+
+    //! \brief Behind the last candidate.
+    auto end() const
+    {
+        return items.cbegin() + size;
+    }
+};
+
+//! \brief The operation of a search step.
+enum class StepKind : uint8_t
+{
+    loop_left,  //!< Extend the query to the left (5') with a loop character.
+    loop_right, //!< Extend the query to the right (3') with a loop character.
+    stem,       //!< Extend the query at both sides with a base pair.
+    report      //!< The motif is complete: report the occurrences of the query.
+};
+
+//! \brief A step of a compiled search program, which corresponds to a profile column of the motif.
+struct SearchStep
+{
+    StepKind kind;        //!< The operation of the step.
+    uint32_t candidates;  //!< The position of the candidate list in the loop or stem candidates of the program.
+    uint32_t gaps_begin;  //!< The first jump target in the gap targets of the program.
+    uint32_t gaps_end;    //!< Behind the last jump target in the gap targets of the program.
+    float best_remaining; //!< The best score that can be added from this step until the report step.
+    bool gap_target;      //!< Whether a gap jumps to this step, i.e. different paths may reach it with the same query.
+};
+
+/*!
+ * \brief A motif that is lowered into a linear sequence of search steps.
+ *
+ * \details
+ * The steps are ordered as the search visits the profile columns, starting at the hairpin loop.
+ * A step either extends the query with one of its candidates and continues with the next step,
+ * or it skips a gap and continues with one of its jump targets. The last step reports the hits.
+ */
+struct SearchProgram
+{
+    StemloopMotif const * motif{nullptr};                                    //!< The compiled motif.
+    std::vector<SearchStep> steps{};                                         //!< The steps, ending with a report.
+    std::vector<CandidateList<seqan3::rna4>> loop_candidates{};              //!< The candidates of loop steps.
+    std::vector<CandidateList<bi_alphabet<seqan3::rna4>>> stem_candidates{}; //!< The candidates of stem steps.
+    std::vector<uint32_t> gap_targets{};                                     //!< The jump targets of all gaps.
+    bool reverse{false};                                                     //!< Whether it searches the reverse
+                                                                             //!< complement of the motif.
+};
+
+/*!
+ * \brief Remembers search states that have been explored completely, such that dominated revisits can be skipped.
+ *
+ * \details
+ * A state consists of a program step and a query. The subtree below a state depends only on them and on the scores
+ * of the previous steps that the xdrop condition looks at. A revisit is dominated if its score is not higher and
+ * its previous scores, relative to the current score, are not lower: it prunes at least the same branches and all
+ * of its leaves have already been recorded with at least the same score.
+ */
+class TranspositionTable
 {
 private:
-    using ElementIter = typename std::vector<std::variant<LoopElement, StemElement>>::const_reverse_iterator;
+    //! \brief A completely explored state.
+    struct Entry
+    {
+        uint32_t step;                            //!< The program step.
+        seqan3::bi_fm_index_cursor<Index> cursor; //!< The cursor of the query.
+        float score;                              //!< The score of the query.
+        size_t history;                           //!< The position of the previous scores in `histories`.
+    };
+
+    //! \brief The explored states, keyed by a hash of the step and the query.
+    std::unordered_multimap<uint64_t, Entry> entries;
+
+    //! \brief The previous scores of all entries relative to their score, `window` values per entry.
+    std::vector<float> histories;
 
-    BiDirectionalIndex & bds;
-    std::vector<std::vector<Hit>> hits;
+    //! \brief The number of previous scores that influence the xdrop condition in the subtree.
+    size_t const window;
+
+    //! \brief The maximum number of entries, which bounds the memory usage.
+    static constexpr size_t max_entries{1u << 20};
+
+    //! \brief The hash key of a state.
+    static uint64_t key(uint32_t step, BiDirectionalSearch const & bds)
+    {
+        return bds.query_hash() ^ ((step + 1ull) * 0xC2B2AE3D27D4EB4Full);
+    }
+
+    //! \brief Find the entry of the given state.
+    Entry * find(uint32_t step, BiDirectionalSearch const & bds);
+
+public:
+    /*!
+     * \brief Construct an empty table.
+     * \param xdrop The xdrop parameter of the search.
+     */
+    explicit TranspositionTable(unsigned char xdrop) :
+        entries{},
+        histories{},
+        window{xdrop > 1u ? xdrop - 1u : 0u}
+    {}
+
+    /*!
+     * \brief Check whether the current state of a search is dominated by an explored state.
+     * \param step The current program step.
+     * \param bds The search.
+     * \return whether the subtree can be skipped.
+     */
+    bool dominated(uint32_t step, BiDirectionalSearch const & bds);
+
+    /*!
+     * \brief Record the current state of a search after its subtree has been explored completely.
+     * \param step The current program step.
+     * \param bds The search.
+     */
+    void insert(uint32_t step, BiDirectionalSearch const & bds);
+};
+
+class SearchGenerator
+{
+private:
+    BiDirectionalIndex const & index;
+    std::vector<HitRecord> hits;
+    HitEncoding encoding;
     MotifScore const log_depth;
     BackgroundDistribution const background_distr;
-    std::set<MotifLocation, MotifLocationCompare> locations;
+    std::vector<MotifLocation> locations;
+    size_t max_offset;
+    unsigned char const xdrop;
+    unsigned int const threads;
+    unsigned int const split_depth;
+    float const min_score;
+    size_t const max_hits;
+    float const min_hit_score;
+    bool const both_strands;
+
+    void run_program(BiDirectionalSearch & bds,
+                     LeafList & leaves,
+                     TranspositionTable & table,
+                     SearchProgram const & program,
+                     uint32_t step_idx,
+                     unsigned int depth) const;
 
-    template <typename MotifElement>
-    void recurse_search(StemloopMotif const & motif, ElementIter const & elem_it, MotifLen idx);
+    void descend(BiDirectionalSearch & bds,
+                 LeafList & leaves,
+                 TranspositionTable & table,
+                 LeafList * subtree_leaves,
+                 SearchProgram const & program,
+                 uint32_t step_idx,
+                 unsigned int depth) const;
 
     template <seqan3::semialphabet Alphabet>
-    inline std::set<std::pair<MotifScore, Alphabet>> priority(profile_char<Alphabet> const & prof) const;
+    CandidateList<Alphabet> priority(profile_char<Alphabet> const & prof) const;
+
+    void cluster_hits(std::vector<HitRecord>::const_iterator seq_begin,
+                      std::vector<HitRecord>::const_iterator seq_end,
+                      std::vector<float> & max_score,
+                      std::vector<Hit> & selection,
+                      std::vector<MotifLocation> & results) const;
 
 public:
-    SearchGenerator(BiDirectionalIndex & bds, SeqNum depth) :
-        bds{bds},
+    SearchGenerator(BiDirectionalIndex const & index,
+                    SeqNum depth,
+                    unsigned char xdrop = 4,
+                    unsigned int threads = 1,
+                    unsigned int split_depth = 2,
+                    float min_score = std::numeric_limits<float>::lowest(),
+                    size_t max_hits = 0,
+                    float min_hit_score = std::numeric_limits<float>::lowest(),
+                    bool both_strands = false) :
+        index{index},
         hits{},
+        encoding{},
         log_depth{log2f(depth)},
         background_distr{},
-        locations{}
+        locations{},
+        max_offset{0},
+        xdrop{xdrop},
+        threads{threads},
+        split_depth{threads > 1 ? split_depth : 0u}, // splitting is pointless without concurrency
+        min_score{min_score},
+        max_hits{max_hits},
+        min_hit_score{min_hit_score},
+        both_strands{both_strands}
     {}
 
-    void find_motifs(std::vector<StemloopMotif> const & motifs);
+    /*!
+     * \brief Lower a motif into a search program, whose candidate lists are computed once for every profile column.
+     * \param motif The motif, which must outlive the program.
+     * \return the program that searches the motif on the forward strand.
+     */
+    SearchProgram compile(StemloopMotif const & motif) const;
+
+    /*!
+     * \brief Search the motifs in the index and cluster the hits into motif locations.
+     * \param motifs The motifs.
+     * \param report An optional callback for the results.
+     *
+     * \details
+     * Without a callback, the locations are collected and available via get_locations().
+     * With a callback and without a hit limit, the locations of each sequence and strand are reported as soon as they
+     * are clustered, in the order of the sequences with the forward strand first, and they are not kept.
+     * With a hit limit, the best locations are reported at once after the search.
+     */
+    void find_motifs(std::vector<StemloopMotif> const & motifs, LocationCallback const & report = nullptr);
 
-    std::set<MotifLocation, MotifLocationCompare> const & get_locations() const
+    //! \brief The clustered motif locations, sorted by MotifLocationCompare.
+    std::vector<MotifLocation> const & get_locations() const
     {
         return locations;
     }
@@ -33,6 +33,9 @@ bool Settings::parse_arguments(int argc, char ** argv, std::ostream & out)
     parser.add_option(genome_file, 'g', "genome",
                       "A sequence file containing one or more sequences.");
 
+    parser.add_option(append_file, '\0', "append",
+                      "A sequence file whose sequences are added to the index of the genome as a new segment.");
+
     //output path as option, otherwise output is printed
     parser.add_option(result_file, 'o', "output",
                       "The output file for the results. If empty we print to stdout.");
@@ -43,6 +46,46 @@ bool Settings::parse_arguments(int argc, char ** argv, std::ostream & out)
     parser.add_option(threads, 'j', "threads",
                       "Use the number of specified threads. Value 0 tries to detect the maximum number.");
 
+    parser.add_option(min_score, '\0', "min-score",
+                      "Skip the search branches that cannot reach this score for a single stem loop. "
+                      "By default, all branches are searched that pass the xdrop condition.");
+
+    parser.add_option(max_hits, '\0', "max-hits",
+                      "Report only the given number of best scoring hits. Value 0 reports all hits.");
+
+    parser.add_option(min_hit_score, '\0', "min-hit-score",
+                      "Report only the hits that reach this score. By default, all hits are reported.");
+
+    parser.add_option(strand, '\0', "strand",
+                      "Search the forward strand only, or both strands with the reverse complement of the motifs.",
+                      seqan3::option_spec::DEFAULT, seqan3::value_list_validator{"forward", "both"});
+
+    parser.add_option(split_depth, '\0', "split-depth",
+                      "The number of search steps in which the branches of a motif search are distributed among the "
+                      "threads. Larger values balance the work better but create more tasks.");
+
+    parser.add_option(index_options.max_memory, 'm', "max-memory",
+                      "The memory limit in MiB for building the index. Value 0 means no limit. The genome is "
+                      "split into more shards to meet the limit, but the longest sequence must fit into it.");
+
+    parser.add_option(index_options.shards, 's', "shards",
+                      "The number of shards into which a new index is split. More shards are created if the memory "
+                      "limit requires it.");
+
+    parser.add_flag(index_options.compress, 'z', "compress-index",
+                    "Write a new index in blocks that are compressed and decompressed in parallel.");
+
+    parser.add_flag(index_options.store_text, 't', "store-text",
+                    "Store the genome in 2-bit packed form in a new index, such that hit sequences can be extracted "
+                    "and segments can be merged without the FASTA files.");
+
+    parser.add_option(index_options.max_segments, '\0', "compact-segments",
+                      "Merge the index segments in the background when there are more than this number. "
+                      "Value 0 disables the compaction.");
+
+    parser.add_flag(index_info, 'i', "index-info",
+                    "Print information about the index of the genome file and exit.");
+
     parser.add_option(verbose, 'v', "verbose",
                       "Level of printing status information.");
 
@@ -61,6 +104,7 @@ bool Settings::parse_arguments(int argc, char ** argv, std::ostream & out)
         unsigned int nthreads = std::thread::hardware_concurrency();
         threads = nthreads != 0u ? nthreads : 1u;
     }
+    index_options.threads = threads;
     if (verbose > 0)
         std::cerr << "Number of threads: " << threads << std::endl;
 
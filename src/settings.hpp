@@ -2,6 +2,10 @@
 
 #include <seqan3/std/filesystem>
 #include <fstream>
+#include <limits>
+#include <string>
+
+#include "index_io.hpp"
 
 namespace mars
 {
@@ -17,8 +21,16 @@ private:
 public:
     std::filesystem::path alignment_file{};
     std::filesystem::path genome_file{};
+    std::filesystem::path append_file{};
     unsigned char xdrop{4};
     unsigned int threads{1};
+    unsigned int split_depth{2};
+    float min_score{std::numeric_limits<float>::lowest()};
+    size_t max_hits{0};
+    float min_hit_score{std::numeric_limits<float>::lowest()};
+    std::string strand{"forward"};
+    IndexOptions index_options{};
+    bool index_info{false};
 
     bool parse_arguments(int argc, char ** argv, std::ostream & out);
 };
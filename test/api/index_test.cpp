@@ -1,5 +1,12 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
 #include <seqan3/alphabet/nucleotide/rna4.hpp>
 
 #include "index.hpp"
@@ -10,52 +17,738 @@ std::filesystem::path data(std::string const & filename)
     return std::filesystem::path{std::string{DATADIR}}.concat(filename);
 }
 
+// Append a single character to the query of a search, which extends only the requested character.
+bool append_loop(mars::BiDirectionalSearch & bds, std::pair<float, seqan3::rna4> item, bool left)
+{
+    bds.compute_loop_children(1u << item.second.to_rank(), left);
+    return bds.append_child(item, left);
+}
+
+// Append a single character pair to both sides of the query of a search.
+bool append_stem(mars::BiDirectionalSearch & bds, std::pair<float, mars::bi_alphabet<seqan3::rna4>> stem_item)
+{
+    using seqan3::get;
+    bds.compute_loop_children(1u << get<0>(stem_item.second).to_rank(), true);
+    return bds.append_stem_child(stem_item);
+}
+
 TEST(Index, Create)
 {
     // from fasta file
-    mars::BiDirectionalIndex bds(4);
+    mars::BiDirectionalIndex bds{};
     EXPECT_NO_THROW(bds.create(data("genome.fa")));
-#ifdef SEQAN3_HAS_ZLIB
-    std::filesystem::path const indexfile = data("genome.fa.marsindex.gz");
-#else
     std::filesystem::path const indexfile = data("genome.fa.marsindex");
-#endif
     EXPECT_TRUE(std::filesystem::exists(indexfile));
+
+    // from memory-mappable index
+    mars::BiDirectionalIndex bds_mapped{};
+    EXPECT_NO_THROW(bds_mapped.create(data("genome.fa")));
+    EXPECT_EQ(bds_mapped.number_of_seq(), 3ul);
+    EXPECT_EQ(bds_mapped.get_name(0), "genome_a");
+    EXPECT_EQ(bds_mapped.get_name(2), "genome_c");
     std::filesystem::remove(indexfile);
 
-    // from archive
-    EXPECT_NO_THROW(bds.create(data("genome2.fa")));
+    // archives of previous versions have the default sampling
+    if constexpr (mars::default_sa_sampling)
+    {
+        // from archive of a previous version
+        EXPECT_NO_THROW(bds.create(data("genome2.fa")));
 
-    // from compressed archive
+        // from compressed archive
 #ifdef SEQAN3_HAS_ZLIB
-    EXPECT_NO_THROW(bds.create(data("genome3.fa")));
+        EXPECT_NO_THROW(bds.create(data("genome3.fa")));
+#endif
+    }
+}
+
+// Read the whole content of a file into a string.
+std::string file_content(std::filesystem::path const & filepath)
+{
+    std::ifstream ifs{filepath, std::ios::binary};
+    return std::string{std::istreambuf_iterator<char>{ifs}, std::istreambuf_iterator<char>{}};
+}
+
+TEST(Index, ParallelConstruction)
+{
+    std::filesystem::path const indexfile = data("genome.fa.marsindex");
+    std::filesystem::remove(indexfile);
+
+    mars::BiDirectionalIndex bds_single{};
+    bds_single.create(data("genome.fa"), mars::IndexOptions{1});
+    std::string const single_content = file_content(indexfile);
+    std::filesystem::remove(indexfile);
+
+    mars::BiDirectionalIndex bds_parallel{};
+    bds_parallel.create(data("genome.fa"), mars::IndexOptions{4});
+    std::string const parallel_content = file_content(indexfile);
+    std::filesystem::remove(indexfile);
+
+    EXPECT_FALSE(single_content.empty());
+    EXPECT_EQ(single_content, parallel_content);
+}
+
+TEST(Index, Sampling)
+{
+    std::filesystem::path const indexfile = data("genome.fa.marsindex");
+    std::filesystem::remove(indexfile);
+
+    mars::BiDirectionalIndex bds{};
+    bds.create(data("genome.fa"));
+    mars::IndexHeader header{};
+    std::string content = file_content(indexfile);
+    std::memcpy(&header, content.data(), sizeof(header));
+    EXPECT_EQ(header.sa_sampling, mars::sa_sampling_rate);
+    EXPECT_EQ(header.sa_strategy, static_cast<uint32_t>(mars::sa_sampling_strategy));
+
+    // an index with a different sampling is refused and kept as it is
+    header.sa_sampling = mars::sa_sampling_rate + 1;
+    std::memcpy(content.data(), &header, sizeof(header));
+    {
+        std::ofstream ofs{indexfile, std::ios::binary};
+        ofs << content;
+    }
+    mars::BiDirectionalIndex bds_refused{};
+    EXPECT_THROW(bds_refused.create(data("genome.fa")), std::runtime_error);
+    EXPECT_EQ(file_content(indexfile), content);
+    std::filesystem::remove(indexfile);
+}
+
+TEST(Index, Header)
+{
+    // the test modifies the genome file, so it works on a copy in its own directory
+    std::filesystem::path const test_dir{std::string{OUTPUTDIR} + "Index.Header"};
+    std::filesystem::remove_all(test_dir);
+    std::filesystem::create_directories(test_dir);
+    std::filesystem::path const genomefile = test_dir / "genome.fa";
+    std::filesystem::path const indexfile = test_dir / "genome.fa.marsindex";
+    std::filesystem::copy_file(data("genome.fa"), genomefile);
+
+    mars::BiDirectionalIndex bds{};
+    bds.create(genomefile, mars::IndexOptions{1, 0, 2});
+    mars::IndexHeader header{};
+    ASSERT_TRUE(mars::read_index_header(header, indexfile));
+    EXPECT_EQ(header.num_seq, 3ul);
+    EXPECT_EQ(header.num_shards, 2u);
+    EXPECT_EQ(header.build_shards, 2u);
+    EXPECT_EQ(header.genome.total_length, 198ul);
+    EXPECT_EQ(header.genome.file_size, std::filesystem::file_size(genomefile));
+    EXPECT_NE(header.genome.checksum, 0ul);
+    EXPECT_FALSE(mars::index_is_outdated(header, genomefile));
+
+    std::ostringstream info{};
+    mars::print_index_info(info, header, genomefile);
+    EXPECT_NE(info.str().find("up to date"), std::string::npos);
+
+    // a modified genome file causes a rebuild
+    std::filesystem::last_write_time(genomefile, std::filesystem::last_write_time(genomefile) + std::chrono::hours(1));
+    EXPECT_TRUE(mars::index_is_outdated(header, genomefile));
+    mars::BiDirectionalIndex bds_rebuilt{};
+    bds_rebuilt.create(genomefile);
+    ASSERT_TRUE(mars::read_index_header(header, indexfile));
+    EXPECT_FALSE(mars::index_is_outdated(header, genomefile));
+    EXPECT_EQ(header.num_shards, 1u);
+    std::filesystem::remove_all(test_dir);
+}
+
+TEST(Index, MemoryLimit)
+{
+    std::filesystem::path const test_dir{std::string{OUTPUTDIR} + "Index.MemoryLimit"};
+    std::filesystem::remove_all(test_dir);
+    std::filesystem::create_directories(test_dir);
+    std::filesystem::path const genomefile = test_dir / "genome.fa";
+    std::filesystem::path const indexfile = test_dir / "genome.fa.marsindex";
+    {
+        std::ofstream ofs{genomefile};
+        for (char const * name : {"genome_a", "genome_b"})
+            ofs << ">" << name << "\n" << std::string(300000, 'A') << "GCAC\n";
+    }
+
+    // each sequence fits into the budget, but not both of them
+    mars::BiDirectionalIndex bds{};
+    EXPECT_NO_THROW(bds.create(genomefile, mars::IndexOptions{1, 4}));
+    EXPECT_EQ(bds.number_of_shards(), 2ul);
+    std::filesystem::remove(indexfile);
+
+    // a single sequence exceeds the budget and is not split
+    mars::BiDirectionalIndex bds_small{};
+    EXPECT_THROW(bds_small.create(genomefile, mars::IndexOptions{1, 2}), std::runtime_error);
+    EXPECT_FALSE(std::filesystem::exists(indexfile));
+    std::filesystem::remove_all(test_dir);
+}
+
+// A located hit with the global number of its sequence.
+struct LocatedHit
+{
+    size_t seq;
+    size_t pos;
+    float score;
+    uint8_t midx;
+};
+
+// Locate the occurrences of the current query of a search as a leaf of the given motif.
+std::vector<LocatedHit> locate(mars::BiDirectionalSearch const & bds, mars::IndexShard const & shard, uint8_t midx = 0)
+{
+    mars::LeafList leaves{};
+    bds.record_leaf(leaves);
+    mars::StemloopMotif const motif{midx, {0, 4}};
+    mars::HitEncoding const encoding{shard.first_seq + shard.num_seq, shard.index.size(), 0u, midx + 1u};
+    std::vector<mars::HitRecord> records(leaves.front().cursor.count());
+    mars::locate_leaf(records.data(), leaves.front(), shard.first_seq, motif, 0u, encoding);
+
+    std::vector<LocatedHit> hits{};
+    for (mars::HitRecord const & record : records)
+        hits.push_back(LocatedHit{encoding.seq(record.key),
+                                  encoding.pos(record.key),
+                                  encoding.score(record.key),
+                                  encoding.midx(record.key)});
+    return hits;
+}
+
+// Search the pattern GCAC in all shards of an index and return the hits.
+std::vector<std::vector<mars::Hit>> search_gcac(mars::BiDirectionalIndex const & index)
+{
+    using seqan3::operator""_rna4;
+
+    std::vector<std::vector<mars::Hit>> hits(index.number_of_seq());
+    for (size_t idx = 0; idx < index.number_of_shards(); ++idx)
+    {
+        mars::BiDirectionalSearch bds{index.shard(idx), 4};
+        if (append_loop(bds, {0.f, 'C'_rna4}, true) &&
+            append_loop(bds, {0.f, 'A'_rna4}, true) &&
+            append_loop(bds, {0.f, 'C'_rna4}, true) &&
+            append_loop(bds, {0.f, 'G'_rna4}, true))
+        {
+            for (LocatedHit const & hit : locate(bds, index.shard(idx)))
+                hits[hit.seq].emplace_back(hit.pos, hit.midx, hit.score);
+        }
+    }
+    for (auto & seq_hits : hits)
+        std::sort(seq_hits.begin(), seq_hits.end(), [] (mars::Hit const & a, mars::Hit const & b)
+        {
+            return a.pos < b.pos;
+        });
+    return hits;
+}
+
+TEST(Index, Shards)
+{
+    std::filesystem::path const indexfile = data("genome.fa.marsindex");
+    std::filesystem::remove(indexfile);
+
+    mars::BiDirectionalIndex bds_single{};
+    bds_single.create(data("genome.fa"), mars::IndexOptions{1});
+    EXPECT_EQ(bds_single.number_of_shards(), 1ul);
+    std::filesystem::remove(indexfile);
+
+    mars::BiDirectionalIndex bds_sharded{};
+    bds_sharded.create(data("genome.fa"), mars::IndexOptions{2, 0, 3});
+    ASSERT_EQ(bds_sharded.number_of_shards(), 3ul);
+    for (size_t idx = 0; idx < bds_sharded.number_of_shards(); ++idx)
+    {
+        EXPECT_EQ(bds_sharded.shard(idx).first_seq, idx);
+        EXPECT_EQ(bds_sharded.shard(idx).num_seq, 1ul);
+    }
+
+    // the shards are loaded from file
+    mars::BiDirectionalIndex bds_mapped{};
+    bds_mapped.create(data("genome.fa"), mars::IndexOptions{2});
+    EXPECT_EQ(bds_mapped.number_of_shards(), 3ul);
+    EXPECT_EQ(bds_mapped.get_name(1), "genome_b");
+
+    // a single shard can be loaded independently
+    mars::IndexShard shard{};
+    EXPECT_TRUE(mars::read_shard(shard, indexfile, 2));
+    EXPECT_EQ(shard.first_seq, 2ul);
+    EXPECT_FALSE(mars::read_shard(shard, indexfile, 3));
+    std::filesystem::remove(indexfile);
+
+    // the hits are reported with global sequence numbers
+    auto const single_hits = search_gcac(bds_single);
+    auto const sharded_hits = search_gcac(bds_mapped);
+    ASSERT_EQ(single_hits.size(), sharded_hits.size());
+    for (size_t seq = 0; seq < single_hits.size(); ++seq)
+    {
+        ASSERT_EQ(single_hits[seq].size(), sharded_hits[seq].size());
+        for (size_t idx = 0; idx < single_hits[seq].size(); ++idx)
+            EXPECT_EQ(single_hits[seq][idx].pos, sharded_hits[seq][idx].pos);
+    }
+    EXPECT_EQ(sharded_hits[0].size(), 1ul);
+    EXPECT_EQ(sharded_hits[2].size(), 1ul);
+}
+
+#ifdef SEQAN3_HAS_ZLIB
+TEST(Index, Compressed)
+{
+    std::filesystem::path const indexfile = data("genome.fa.marsindex");
+    std::filesystem::remove(indexfile);
+
+    mars::BiDirectionalIndex bds_single{};
+    bds_single.create(data("genome.fa"), mars::IndexOptions{1});
+    std::filesystem::remove(indexfile);
+
+    mars::BiDirectionalIndex bds_compressed{};
+    bds_compressed.create(data("genome.fa"), mars::IndexOptions{4, 0, 2, true});
+    EXPECT_EQ(file_content(indexfile).substr(0, 7), "MARSBGZ");
+
+    // the blocks are decompressed when the index is read
+    mars::BiDirectionalIndex bds_read{};
+    bds_read.create(data("genome.fa"), mars::IndexOptions{4});
+    EXPECT_EQ(bds_read.number_of_shards(), 2ul);
+    EXPECT_EQ(bds_read.number_of_seq(), 3ul);
+    EXPECT_EQ(bds_read.get_name(2), "genome_c");
+
+    // a single shard is inflated independently
+    mars::IndexShard shard{};
+    EXPECT_TRUE(mars::read_shard(shard, indexfile, 1));
+    EXPECT_EQ(shard.first_seq, bds_read.shard(1).first_seq);
+    EXPECT_EQ(shard.num_seq, bds_read.shard(1).num_seq);
+    EXPECT_EQ(shard.index.size(), bds_read.shard(1).index.size());
+    EXPECT_FALSE(mars::read_shard(shard, indexfile, 2));
+    std::filesystem::remove(indexfile);
+
+    auto const single_hits = search_gcac(bds_single);
+    auto const compressed_hits = search_gcac(bds_read);
+    ASSERT_EQ(single_hits.size(), compressed_hits.size());
+    for (size_t seq = 0; seq < single_hits.size(); ++seq)
+        EXPECT_EQ(single_hits[seq].size(), compressed_hits[seq].size());
+}
+
+TEST(Index, CompressedBlocks)
+{
+    // The name table spans several blocks, such that the header and the shard table leave the buffer early.
+    std::filesystem::path const genomefile = data("genome_blocks.fa");
+    std::filesystem::path const indexfile = data("genome_blocks.fa.marsindex");
+    std::filesystem::remove(indexfile);
+    {
+        std::ofstream ofs{genomefile};
+        for (size_t idx = 0; idx < 30000u; ++idx)
+            ofs << ">sequence_" << idx << std::string(60, 'x') << "\nACGTTGCAGCACGT\n";
+    }
+
+    mars::BiDirectionalIndex bds{};
+    bds.create(genomefile, mars::IndexOptions{1, 0, 2, true});
+    EXPECT_EQ(file_content(indexfile).substr(0, 7), "MARSBGZ");
+
+    mars::IndexHeader header{};
+    EXPECT_TRUE(mars::read_index_header(header, indexfile));
+    EXPECT_EQ(header.num_seq, 30000ul);
+    EXPECT_EQ(header.num_shards, 2u);
+
+    mars::BiDirectionalIndex bds_read{};
+    bds_read.create(genomefile);
+    EXPECT_EQ(bds_read.number_of_seq(), 30000ul);
+    EXPECT_EQ(bds_read.number_of_shards(), 2ul);
+    EXPECT_EQ(bds_read.get_name(29999), "sequence_29999" + std::string(60, 'x'));
+
+    mars::IndexShard shard{};
+    EXPECT_TRUE(mars::read_shard(shard, indexfile, 1));
+    EXPECT_EQ(shard.first_seq, bds_read.shard(1).first_seq);
+    EXPECT_EQ(shard.index.size(), bds_read.shard(1).index.size());
+    std::filesystem::remove(indexfile);
+    std::filesystem::remove(genomefile);
+}
 #endif
+
+TEST(Index, Append)
+{
+    std::filesystem::path const genomefile = data("genome.fa");
+    std::filesystem::path const indexfile = data("genome.fa.marsindex");
+    std::filesystem::path const appendfile = data("genome_append.fa");
+    std::filesystem::remove(indexfile);
+    {
+        std::ofstream ofs{appendfile};
+        ofs << ">genome_d\nAAAAAAAAGCACAAAAAAAA\n";
+    }
+
+    mars::BiDirectionalIndex bds{};
+    bds.append(genomefile, appendfile);
+    EXPECT_EQ(bds.number_of_seq(), 4ul);
+    EXPECT_EQ(bds.number_of_shards(), 2ul);
+    EXPECT_EQ(bds.number_of_segments(), 2ul);
+    EXPECT_EQ(bds.shard(1).first_seq, 3ul);
+    EXPECT_EQ(bds.get_name(3), "genome_d");
+
+    // the appended segment is stored in the index file
+    mars::BiDirectionalIndex bds_read{};
+    bds_read.create(genomefile);
+    EXPECT_EQ(bds_read.number_of_seq(), 4ul);
+    EXPECT_EQ(bds_read.number_of_segments(), 2ul);
+    auto const hits = search_gcac(bds_read);
+    ASSERT_EQ(hits.size(), 4ul);
+    ASSERT_EQ(hits[3].size(), 1ul);
+    EXPECT_EQ(hits[3][0].pos, 8ul);
+
+    // files that are already part of the index are rejected
+    mars::BiDirectionalIndex bds_duplicate{};
+    EXPECT_THROW(bds_duplicate.append(genomefile, appendfile), std::runtime_error);
+    EXPECT_THROW(bds_duplicate.append(genomefile, genomefile), std::runtime_error);
+    EXPECT_EQ(bds_duplicate.number_of_seq(), 4ul);
+
+    // the compaction merges the segments
+    mars::BiDirectionalIndex bds_compacted{};
+    bds_compacted.compact(genomefile);
+    EXPECT_EQ(bds_compacted.number_of_seq(), 4ul);
+    EXPECT_EQ(bds_compacted.number_of_shards(), 1ul);
+    EXPECT_EQ(bds_compacted.number_of_segments(), 1ul);
+    mars::BiDirectionalIndex bds_reread{};
+    bds_reread.create(genomefile);
+    EXPECT_EQ(bds_reread.number_of_segments(), 1ul);
+    EXPECT_EQ(search_gcac(bds_reread)[3].size(), 1ul);
+
+    std::filesystem::remove(indexfile);
+    std::filesystem::remove(appendfile);
+}
+
+TEST(Index, StoreText)
+{
+    using seqan3::operator""_dna4;
+
+    std::filesystem::path const genomefile = data("genome.fa");
+    std::filesystem::path const indexfile = data("genome.fa.marsindex");
+    std::filesystem::path const appendfile = data("genome_append.fa");
+    std::filesystem::remove(indexfile);
+    {
+        std::ofstream ofs{appendfile};
+        ofs << ">genome_d\nAAAAAAAAGCACAAAAAAAA\n";
+    }
+
+    mars::IndexOptions options{};
+    options.store_text = true;
+    mars::BiDirectionalIndex bds{};
+    bds.create(genomefile, options);
+    EXPECT_TRUE(bds.has_text());
+    EXPECT_EQ(bds.extract(0, 4, 10), "CGCACA"_dna4);
+
+    mars::IndexHeader header{};
+    ASSERT_TRUE(mars::read_index_header(header, indexfile));
+    EXPECT_EQ(header.build_flags & 2u, 2u);
+    EXPECT_GT(header.text_size, 0ul);
+
+    // the text is read from the index file, and ranges are clipped at the sequence end
+    mars::BiDirectionalIndex bds_read{};
+    bds_read.create(genomefile);
+    ASSERT_TRUE(bds_read.has_text());
+    EXPECT_EQ(bds_read.extract(0, 4, 10), "CGCACA"_dna4);
+    EXPECT_EQ(bds_read.extract(3, 0, 4), seqan3::dna4_vector{});
+    EXPECT_EQ(bds_read.extract(0, 66, 100).size(), 2ul);
+
+    // the text is extended by appended sequences and used for the compaction
+    bds_read.append(genomefile, appendfile);
+    EXPECT_EQ(bds_read.extract(3, 8, 12), "GCAC"_dna4);
+    std::filesystem::remove(appendfile);
+    mars::BiDirectionalIndex bds_compacted{};
+    bds_compacted.compact(genomefile);
+    EXPECT_EQ(bds_compacted.number_of_seq(), 4ul);
+    EXPECT_EQ(bds_compacted.number_of_segments(), 1ul);
+    EXPECT_EQ(bds_compacted.extract(3, 8, 12), "GCAC"_dna4);
+    EXPECT_EQ(search_gcac(bds_compacted)[3].size(), 1ul);
+
+    // an index without text cannot extract
+    std::filesystem::remove(indexfile);
+    mars::BiDirectionalIndex bds_plain{};
+    bds_plain.create(genomefile);
+    EXPECT_FALSE(bds_plain.has_text());
+    EXPECT_TRUE(bds_plain.extract(0, 0, 10).empty());
+    std::filesystem::remove(indexfile);
 }
 
-TEST(Index, BiDirectionalIndex)
+TEST(Index, LoopChildren)
 {
     using seqan3::operator""_rna4;
 
-    mars::BiDirectionalIndex bds(4);
-    bds.create(data("RF00005.fa"));
+    mars::BiDirectionalIndex index{};
+    index.create(data("genome.fa"));
+
+    // the children that are computed together give the same hits as the children that are computed alone
+    for (bool left : {true, false})
+    {
+        mars::BiDirectionalSearch single{index.shard(0), 4};
+        mars::BiDirectionalSearch batch{index.shard(0), 4};
+        ASSERT_TRUE(append_loop(single, {0.f, 'C'_rna4}, left));
+        ASSERT_TRUE(append_loop(batch, {0.f, 'C'_rna4}, left));
+        batch.compute_loop_children(0b1111u, left);
+        for (seqan3::rna4 c : {'A'_rna4, 'C'_rna4, 'G'_rna4, 'U'_rna4})
+        {
+            bool const succ = append_loop(single, {1.f, c}, left);
+            EXPECT_EQ(batch.append_child({1.f, c}, left), succ);
+            if (succ)
+            {
+                EXPECT_EQ(locate(batch, index.shard(0)).size(), locate(single, index.shard(0)).size());
+                EXPECT_EQ(batch.score(), single.score());
+                EXPECT_EQ(batch.query_hash(), single.query_hash());
+                single.backtrack();
+                batch.backtrack();
+            }
+        }
+
+        // characters that were not requested are not appended
+        batch.compute_loop_children(0b0001u, left);
+        EXPECT_FALSE(batch.append_child({0.f, 'G'_rna4}, left));
+    }
+    std::filesystem::remove(data("genome.fa.marsindex"));
+}
+
+TEST(Index, StemChildren)
+{
+    using seqan3::operator""_rna4;
+
+    mars::BiDirectionalIndex index{};
+    index.create(data("genome.fa"));
+
+    // the pairs that share the left extension give the same hits as the pairs that are extended alone
+    mars::BiDirectionalSearch single{index.shard(0), 4};
+    mars::BiDirectionalSearch batch{index.shard(0), 4};
+    ASSERT_TRUE(append_loop(single, {0.f, 'A'_rna4}, true));
+    ASSERT_TRUE(append_loop(batch, {0.f, 'A'_rna4}, true));
+    batch.compute_loop_children(0b1111u, true);
+    for (seqan3::rna4 c5 : {'A'_rna4, 'C'_rna4, 'G'_rna4, 'U'_rna4})
+    {
+        for (seqan3::rna4 c3 : {'A'_rna4, 'C'_rna4, 'G'_rna4, 'U'_rna4})
+        {
+            mars::bi_alphabet const ba{c5, c3};
+            bool const succ = append_stem(single, {1.f, ba});
+            EXPECT_EQ(batch.append_stem_child({1.f, ba}), succ);
+            if (succ)
+            {
+                EXPECT_EQ(locate(batch, index.shard(0)).size(), locate(single, index.shard(0)).size());
+                EXPECT_EQ(batch.query_hash(), single.query_hash());
+                single.backtrack();
+                batch.backtrack();
+            }
+        }
+    }
+    std::filesystem::remove(data("genome.fa.marsindex"));
+}
+
+TEST(Index, SearchStack)
+{
+    using seqan3::operator""_rna4;
+
+    mars::BiDirectionalIndex index{};
+    index.create(data("genome.fa"));
+
+    // the stacks grow beyond the preallocated capacity and are reused after a reset
+    mars::BiDirectionalSearch bds{index.shard(0), 4, 1};
+    for (int round = 0; round < 2; ++round)
+    {
+        EXPECT_TRUE(append_loop(bds, {0.f, 'C'_rna4}, true));
+        EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, true));
+        EXPECT_FALSE(append_loop(bds, {0.f, 'U'_rna4}, true));
+        EXPECT_TRUE(append_loop(bds, {0.f, 'C'_rna4}, true));
+        EXPECT_TRUE(append_loop(bds, {0.f, 'G'_rna4}, true));
+        EXPECT_EQ(locate(bds, index.shard(0)).size(), 2ul);
+
+        // the failed extension and the backtracking restore the previous cursor
+        bds.backtrack();
+        EXPECT_TRUE(append_loop(bds, {1.5f, 'G'_rna4}, true));
+        std::vector<LocatedHit> const hits = locate(bds, index.shard(0));
+        ASSERT_EQ(hits.size(), 2ul);
+        EXPECT_EQ(hits[0].score, 1.5f);
+        bds.reset(index.shard(0));
+    }
+    std::filesystem::remove(data("genome.fa.marsindex"));
+}
+
+TEST(Index, MergeLeaves)
+{
+    using seqan3::operator""_rna4;
+
+    mars::BiDirectionalIndex index{};
+    index.create(data("genome.fa"));
+    mars::LeafList leaves{};
+
+    // the query GCAC is reached twice with different scores and ACAG once
+    mars::BiDirectionalSearch bds{index.shard(0), 4, 4};
+    for (float score : {1.f, 3.f})
+    {
+        EXPECT_TRUE(append_loop(bds, {score, 'C'_rna4}, true));
+        EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, true));
+        EXPECT_TRUE(append_loop(bds, {0.f, 'C'_rna4}, true));
+        EXPECT_TRUE(append_loop(bds, {0.f, 'G'_rna4}, true));
+        bds.record_leaf(leaves);
+        bds.reset(index.shard(0));
+    }
+    EXPECT_TRUE(append_loop(bds, {2.f, 'A'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'C'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'G'_rna4}, false));
+    bds.record_leaf(leaves);
+
+    mars::merge_leaves(leaves);
+    ASSERT_EQ(leaves.size(), 2ul);
+    std::sort(leaves.begin(), leaves.end(), [] (auto const & a, auto const & b) { return a.score < b.score; });
+    EXPECT_EQ(leaves[0].score, 2.f);
+    EXPECT_EQ(leaves[1].score, 3.f);
+
+    mars::StemloopMotif motif{7, {0, 4}};
+    mars::HitEncoding const encoding{index.number_of_seq(), index.shard(0).index.size(), 0u, 8u};
+    std::vector<mars::HitRecord> hits(leaves[1].cursor.count());
+    mars::locate_leaf(hits.data(), leaves[1], 0u, motif, 0u, encoding);
+    std::sort(hits.begin(), hits.end(), [] (auto const & a, auto const & b) { return a.key < b.key; });
+    ASSERT_EQ(hits.size(), 2ul);
+    EXPECT_EQ(encoding.seq(hits[0].key), 0ul);
+    EXPECT_EQ(encoding.pos(hits[0].key), 5ul);
+    EXPECT_EQ(encoding.midx(hits[0].key), 7u);
+    EXPECT_EQ(encoding.score(hits[0].key), 3.f);
+    EXPECT_EQ(encoding.seq(hits[1].key), 2ul);
+    std::filesystem::remove(data("genome.fa.marsindex"));
+}
+
+TEST(Index, MergeHits)
+{
+    using seqan3::operator""_rna4;
+
+    mars::BiDirectionalIndex index{};
+    index.create(data("genome.fa"));
+
+    // the leaf CAC is nested in the leaf CA, which it extends to the right with a better score
+    mars::LeafList leaves{};
+    mars::BiDirectionalSearch bds{index.shard(0), 4};
+    EXPECT_TRUE(append_loop(bds, {1.f, 'C'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, false));
+    bds.record_leaf(leaves);
+    EXPECT_TRUE(append_loop(bds, {1.f, 'C'_rna4}, false));
+    bds.record_leaf(leaves);
+    mars::merge_leaves(leaves);
+    ASSERT_EQ(leaves.size(), 2ul);
+    std::sort(leaves.begin(), leaves.end(), [] (auto const & a, auto const & b) { return a.score < b.score; });
+    size_t const outer_count = leaves[0].cursor.count();
+    size_t const inner_count = leaves[1].cursor.count();
+    ASSERT_GT(outer_count, inner_count);
+
+    mars::StemloopMotif motif{1, {0, 4}};
+    mars::HitEncoding const encoding{index.number_of_seq(), index.shard(0).index.size(), 0u, 2u};
+    std::vector<mars::HitRecord> hits(outer_count + inner_count);
+    mars::locate_leaf(hits.data(), leaves[0], 0u, motif, 0u, encoding);
+    mars::locate_leaf(hits.data() + outer_count, leaves[1], 0u, motif, 0u, encoding);
+    std::sort(hits.begin(), hits.end(), [] (auto const & a, auto const & b) { return a.key < b.key; });
+
+    // each position of CA is reported once, with the score of CAC where it extends to CAC
+    mars::merge_hits(hits);
+    ASSERT_EQ(hits.size(), outer_count);
+    size_t best_hits = 0;
+    for (mars::HitRecord const & hit : hits)
+    {
+        EXPECT_EQ(encoding.midx(hit.key), 1u);
+        best_hits += encoding.score(hit.key) == 2.f ? 1u : 0u;
+    }
+    EXPECT_EQ(best_hits, inner_count);
+    std::filesystem::remove(data("genome.fa.marsindex"));
+}
+
+TEST(Index, LocateReverse)
+{
+    using seqan3::operator""_rna4;
+
+    mars::BiDirectionalIndex index{};
+    index.create(data("genome.fa"));
+
+    // UUUU occurs only in genome_c, the third sequence, starting at its first base
+    mars::BiDirectionalSearch bds{index.shard(0), 4};
+    for (int idx = 0; idx < 4; ++idx)
+        ASSERT_TRUE(append_loop(bds, {0.f, 'U'_rna4}, false));
+    mars::LeafList leaves{};
+    bds.record_leaf(leaves);
+    ASSERT_EQ(leaves.size(), 1ul);
+
+    // the offset of the motif exceeds the forward positions of the first hits
+    mars::StemloopMotif motif{3, {2, 6}};
+    size_t const max_offset = 10;
+    mars::HitEncoding const encoding{index.number_of_seq(), index.shard(0).index.size(), max_offset, 4u};
+    std::vector<mars::HitRecord> hits(leaves[0].cursor.count());
+    mars::locate_leaf(hits.data(), leaves[0], 0u, motif, max_offset, encoding, true);
+
+    std::vector<size_t> positions{};
+    for (mars::HitRecord const & hit : hits)
+    {
+        EXPECT_EQ(encoding.seq(hit.key), 2ul);
+        EXPECT_TRUE(encoding.reverse(hit.key));
+        EXPECT_EQ(encoding.midx(hit.key), 3u);
+        positions.push_back(encoding.mirror(encoding.pos(hit.key) - max_offset + motif.bounds.first));
+    }
+    std::sort(positions.begin(), positions.end());
+    ASSERT_FALSE(positions.empty());
+    EXPECT_EQ(positions.front(), 3ul); // the 5' end of the reverse hit is the fourth base of the forward strand
+    std::filesystem::remove(data("genome.fa.marsindex"));
+}
+
+TEST(Index, HitEncoding)
+{
+    // a single sequence leaves all bits to the position, the motif and the score
+    mars::HitEncoding const single{1u, 1ull << 39, 0u, 256u};
+    uint64_t const key = single.encode(0u, (1ull << 39) - 1u, false, 255u, 2.5f);
+    EXPECT_EQ(single.seq(key), 0ul);
+    EXPECT_EQ(single.pos(key), (1ull << 39) - 1u);
+    EXPECT_EQ(single.midx(key), 255u);
+    EXPECT_EQ(single.score(key), 2.5f);
+
+    // keys are ordered by sequence, position, motif and score
+    mars::HitEncoding const encoding{1000u, 4000000000u, 100u, 4u};
+    EXPECT_LT(encoding.encode(5u, 100u), encoding.encode(5u, 101u));
+    EXPECT_LT(encoding.encode(5u, 100u, false, 3u, 9.f), encoding.encode(5u, 101u));
+    EXPECT_LT(encoding.encode(5u, 100u, false, 1u, 9.f), encoding.encode(5u, 100u, false, 2u));
+    EXPECT_LT(encoding.encode(5u, 100u, false, 1u, 1.f), encoding.encode(5u, 100u, false, 1u, 2.f));
+    EXPECT_LT(encoding.encode(5u, 3999999999u), encoding.encode(6u, 0u));
+    EXPECT_EQ(encoding.seq(encoding.encode(999u, 3999999999u, false, 3u)), 999ul);
+    EXPECT_EQ(encoding.pos(encoding.encode(999u, 3999999999u, false, 3u)), 3999999999ul);
+    EXPECT_EQ(encoding.midx(encoding.encode(999u, 3999999999u, false, 3u)), 3u);
+
+    // the score has a resolution of 1/64, negative scores become 0 and large scores saturate
+    EXPECT_EQ(encoding.score(encoding.encode(5u, 100u, false, 0u, 1.015625f)), 1.015625f);
+    EXPECT_NEAR(encoding.score(encoding.encode(5u, 100u, false, 0u, 0.3f)), 0.3f, 1.f / 128);
+    EXPECT_EQ(encoding.score(encoding.encode(5u, 100u, false, 0u, -3.f)), 0.f);
+    EXPECT_EQ(encoding.score(encoding.encode(5u, 100u, false, 0u, 1e6f)), 65535.f / 64);
+    EXPECT_EQ(encoding.pos(encoding.encode(5u, 100u, false, 0u, 1e6f)), 100ul);
+
+    // an index whose sequence numbers and positions do not fit is rejected
+    EXPECT_THROW((mars::HitEncoding{1ull << 31, 1ull << 32, 0u, 1u}), std::runtime_error);
+
+    // the reverse strand is sorted behind the forward strand and its positions are mirrored
+    EXPECT_LT(encoding.encode(5u, 3999999999u), encoding.encode(5u, 0u, true));
+    EXPECT_LT(encoding.encode(5u, 3999999999u, true), encoding.encode(6u, 0u));
+    EXPECT_FALSE(encoding.reverse(encoding.encode(5u, 3999999999u)));
+    EXPECT_TRUE(encoding.reverse(encoding.encode(5u, 0u, true)));
+    EXPECT_EQ(encoding.pos(encoding.encode(5u, 123u, true)), 123ul);
+    EXPECT_EQ(encoding.mirror(encoding.mirror(12345u)), 12345ul);
+    EXPECT_GT(encoding.mirror(100u), encoding.mirror(101u));
+
+    // the offsets of mirrored positions fit without touching the strand and sequence bits
+    uint64_t const offset_key = encoding.encode(999u, encoding.mirror(0u) + 100u, true);
+    EXPECT_EQ(encoding.seq(offset_key), 999ul);
+    EXPECT_TRUE(encoding.reverse(offset_key));
+    EXPECT_EQ(encoding.pos(offset_key), encoding.mirror(0u) + 100u);
+}
+
+TEST(Index, BiDirectionalSearch)
+{
+    using seqan3::operator""_rna4;
+
+    // the index of RF00005 is an archive of a previous version, which has the default sampling
+    if constexpr (!mars::default_sa_sampling)
+        GTEST_SKIP() << "The archive of a previous version requires the default SA sampling.";
+
+    mars::BiDirectionalIndex index{};
+    index.create(data("RF00005.fa"));
+    mars::BiDirectionalSearch bds{index.shard(0), 4};
     mars::bi_alphabet ba{'U'_rna4, 'C'_rna4};
 
-    EXPECT_TRUE(bds.append_loop({1.f, 'A'_rna4}, false));
-    EXPECT_TRUE(bds.append_stem({2.f, ba}));
-    EXPECT_TRUE(bds.append_loop({0.f, 'A'_rna4}, true));
-    EXPECT_TRUE(bds.append_loop({0.f, 'G'_rna4}, false));
-    EXPECT_TRUE(bds.append_loop({0.f, 'A'_rna4}, false));
-    EXPECT_TRUE(bds.append_loop({0.f, 'A'_rna4}, false));
-    EXPECT_TRUE(bds.append_stem({0.5f, ba}));
+    EXPECT_TRUE(append_loop(bds, {1.f, 'A'_rna4}, false));
+    EXPECT_TRUE(append_stem(bds, {2.f, ba}));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, true));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'G'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, false));
+    EXPECT_TRUE(append_stem(bds, {0.5f, ba}));
     bds.backtrack();
-    EXPECT_TRUE(bds.append_loop({0.f, 'A'_rna4}, false));
-    EXPECT_TRUE(bds.append_loop({0.f, 'G'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'A'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'G'_rna4}, false));
     EXPECT_FALSE(bds.xdrop());
-    EXPECT_TRUE(bds.append_loop({0.f, 'G'_rna4}, false));
-    EXPECT_FALSE(bds.append_loop({0.f, 'G'_rna4}, false));
+    EXPECT_TRUE(append_loop(bds, {0.f, 'G'_rna4}, false));
+    EXPECT_FALSE(append_loop(bds, {0.f, 'G'_rna4}, false));
 
-    std::vector<std::vector<mars::Hit>> hits(10);
-    mars::StemloopMotif motif{0, {27, 47}};
-    bds.compute_hits(hits, motif);
-    EXPECT_EQ(hits.size(), 10ul);
+    for (LocatedHit const & hit : locate(bds, index.shard(0)))
+    {
+        EXPECT_LT(hit.seq, index.number_of_seq());
+        EXPECT_EQ(hit.midx, 0u);
+    }
 }
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+
+#include <array>
+#include <memory>
+
+#include "name_pool.hpp"
+
+TEST(NamePool, Owned)
+{
+    mars::NamePool names{};
+    EXPECT_TRUE(names.empty());
+
+    names.push_back("chr1");
+    names.push_back("");
+    names.push_back("scaffold_42");
+    EXPECT_EQ(names.size(), 3ul);
+    EXPECT_EQ(names[0], "chr1");
+    EXPECT_EQ(names[1], "");
+    EXPECT_EQ(names[2], "scaffold_42");
+    EXPECT_EQ(names.num_chars(), 15ul);
+    EXPECT_EQ(names.offset_data()[2], 4ul);
+
+    mars::NamePool const copy = names;
+    names.clear();
+    EXPECT_TRUE(names.empty());
+    EXPECT_EQ(copy[2], "scaffold_42");
+}
+
+TEST(NamePool, External)
+{
+    auto const offsets = std::make_shared<std::array<uint64_t, 3>>(std::array<uint64_t, 3>{0, 3, 7});
+    char const chars[] = "abcdefg";
+
+    mars::NamePool names{offsets->data(), chars, 2, offsets};
+    EXPECT_EQ(names.size(), 2ul);
+    EXPECT_EQ(names[0], "abc");
+    EXPECT_EQ(names[1], "defg");
+    EXPECT_EQ(offsets.use_count(), 2);
+
+    // appending copies the external names
+    names.push_back("hij");
+    EXPECT_EQ(offsets.use_count(), 1);
+    EXPECT_EQ(names.size(), 3ul);
+    EXPECT_EQ(names[1], "defg");
+    EXPECT_EQ(names[2], "hij");
+}
@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include <seqan3/alphabet/nucleotide/dna4.hpp>
+
+#include "packed_genome.hpp"
+
+TEST(PackedGenome, AppendAndAccess)
+{
+    using seqan3::operator""_dna4;
+
+    mars::PackedGenome genome{};
+    EXPECT_EQ(genome.number_of_seq(), 0ul);
+    EXPECT_EQ(genome.total_length(), 0ul);
+
+    // the second sequence crosses a word boundary
+    seqan3::dna4_vector const seq1 = "ACGTACGT"_dna4;
+    seqan3::dna4_vector const seq2 = "GGGGGGGGGGGGGGGGGGGGGGGGGGGGGGTTTTCA"_dna4;
+    genome.append(seq1);
+    genome.append(seq2);
+    genome.append(seqan3::dna4_vector{});
+
+    EXPECT_EQ(genome.number_of_seq(), 3ul);
+    EXPECT_EQ(genome.total_length(), 44ul);
+    EXPECT_EQ(genome.seq_length(0), 8ul);
+    EXPECT_EQ(genome.seq_length(1), 36ul);
+    EXPECT_EQ(genome.seq_length(2), 0ul);
+    EXPECT_EQ(genome.at(3), 'T'_dna4);
+    EXPECT_EQ(genome.at(43), 'A'_dna4);
+
+    seqan3::dna4_vector unpacked{};
+    for (seqan3::dna4 nt : genome.sequence(1))
+        unpacked.push_back(nt);
+    EXPECT_EQ(unpacked, seq2);
+
+    size_t num_seq = 0;
+    for (auto && seq : genome.sequences())
+        EXPECT_EQ(static_cast<size_t>(std::ranges::distance(seq)), genome.seq_length(num_seq++));
+    EXPECT_EQ(num_seq, 3ul);
+}
+
+TEST(PackedGenome, ExternalView)
+{
+    using seqan3::operator""_dna4;
+
+    mars::PackedGenome genome{};
+    genome.append("ACGTACGT"_dna4);
+    genome.append("GGGGGGGGGGGGGGGGGGGGGGGGGGGGGGTTTTCA"_dna4);
+
+    // a copy of the arrays in external memory, which is owned by the view
+    auto memory = std::make_shared<std::vector<uint64_t>>(genome.start_data(),
+                                                          genome.start_data() + genome.number_of_seq() + 1);
+    memory->insert(memory->end(), genome.word_data(), genome.word_data() + genome.number_of_words());
+    mars::PackedGenome view{memory->data(), memory->data() + 3, 2u, memory};
+    std::weak_ptr<std::vector<uint64_t>> const observer{memory};
+    memory.reset();
+    EXPECT_FALSE(observer.expired());
+
+    EXPECT_EQ(view.number_of_seq(), 2ul);
+    EXPECT_EQ(view.total_length(), 44ul);
+    EXPECT_EQ(view.seq_start(1), 8ul);
+    EXPECT_EQ(view.number_of_words(), 2ul);
+    EXPECT_EQ(view.checksum(), genome.checksum());
+    EXPECT_EQ(view.at(43), 'A'_dna4);
+
+    // appending copies the view into owned memory and releases the external memory
+    view.append("TT"_dna4);
+    EXPECT_TRUE(observer.expired());
+    EXPECT_EQ(view.number_of_seq(), 3ul);
+    EXPECT_EQ(view.total_length(), 46ul);
+    EXPECT_EQ(view.at(3), 'T'_dna4);
+    EXPECT_EQ(view.at(45), 'T'_dna4);
+}
@@ -0,0 +1,44 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "radix_sort.hpp"
+
+TEST(RadixSort, SortStable)
+{
+    struct Record
+    {
+        uint64_t key;
+        uint32_t order;
+    };
+
+    // enough records to be split among the threads, with many equal keys and constant upper bytes
+    std::mt19937_64 rng{17u};
+    std::vector<Record> records(300000);
+    for (uint32_t idx = 0; idx < records.size(); ++idx)
+        records[idx] = {(uint64_t{0xAB} << 56) | (rng() & 0xFFFFFu), idx};
+
+    std::vector<Record> expected = records;
+    std::stable_sort(expected.begin(), expected.end(), [] (Record const & a, Record const & b)
+    {
+        return a.key < b.key;
+    });
+
+    for (unsigned int threads : {1u, 4u})
+    {
+        std::vector<Record> sorted = records;
+        mars::radix_sort(sorted, [] (Record const & rec) { return rec.key; }, threads);
+        ASSERT_EQ(sorted.size(), expected.size());
+        EXPECT_TRUE(std::equal(sorted.begin(), sorted.end(), expected.begin(), [] (Record const & a, Record const & b)
+        {
+            return a.key == b.key && a.order == b.order;
+        }));
+    }
+
+    std::vector<Record> empty{};
+    mars::radix_sort(empty, [] (Record const & rec) { return rec.key; });
+    EXPECT_TRUE(empty.empty());
+}
@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+
+#include <iomanip>
+#include <sstream>
+
+#include "result_writer.hpp"
+
+std::vector<mars::MotifLocation> const locations{{63.3603f, 2, 1043, 0},
+                                                 {12.5f, 3, -4, 17, true},
+                                                 {0.000123456f, 2, 9876543210ll, 5}};
+std::vector<std::string> const names{"chr1", "a_sequence_name_that_is_longer_than_the_column", ""};
+
+TEST(ResultWriter, Format)
+{
+    std::ostringstream expected{};
+    expected << " " << std::left << std::setw(35) << "sequence name" << "\t" << "index" << "\t"
+             << "pos" << "\t" << "n" << "\t" << "score" << std::endl;
+    for (size_t idx = 0; idx < locations.size(); ++idx)
+    {
+        mars::MotifLocation const & loc = locations[idx];
+        expected << ">" << std::left << std::setw(35) << names[idx] << "\t" << loc.sequence << "\t"
+                 << loc.position << "\t" << +loc.num_stemloops << "\t" << loc.score << std::endl;
+    }
+
+    std::ostringstream result{};
+    {
+        mars::ResultWriter writer{result, false, 64}; // small capacity, such that the buffer is written several times
+        writer.write_header();
+        for (size_t idx = 0; idx < locations.size(); ++idx)
+            writer.write(names[idx], locations[idx]);
+    }
+    EXPECT_EQ(result.str(), expected.str());
+}
+
+TEST(ResultWriter, StrandColumn)
+{
+    std::ostringstream expected{};
+    expected << " " << std::left << std::setw(35) << "sequence name" << "\t" << "index" << "\t"
+             << "pos" << "\t" << "strand" << "\t" << "n" << "\t" << "score" << std::endl;
+    for (size_t idx = 0; idx < locations.size(); ++idx)
+    {
+        mars::MotifLocation const & loc = locations[idx];
+        expected << ">" << std::left << std::setw(35) << names[idx] << "\t" << loc.sequence << "\t"
+                 << loc.position << "\t" << (loc.reverse ? '-' : '+') << "\t" << +loc.num_stemloops << "\t"
+                 << loc.score << std::endl;
+    }
+
+    std::ostringstream result{};
+    {
+        mars::ResultWriter writer{result, true, 64};
+        writer.write_header();
+        for (size_t idx = 0; idx < locations.size(); ++idx)
+            writer.write(names[idx], locations[idx]);
+    }
+    EXPECT_EQ(result.str(), expected.str());
+}
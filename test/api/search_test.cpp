@@ -0,0 +1,507 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <tuple>
+#include <variant>
+#include <vector>
+
+#include <seqan3/alphabet/nucleotide/rna4.hpp>
+#include <seqan3/alphabet/nucleotide/rna15.hpp>
+
+#include "index.hpp"
+#include "motif.hpp"
+#include "search.hpp"
+
+// A cloverleaf structure with three stem loops.
+std::string const structure{"(((((((..((((........))))..(((((.......)))))....(((((.......))))))))))))...."};
+size_t const sequence_length{4000};
+
+// The sequence, position and strand of the consensus sequences that are inserted into the genome.
+std::vector<std::tuple<size_t, size_t, bool>> const insertions{{0, 500, false}, {0, 2500, false},
+                                                               {1, 1200, true},
+                                                               {2, 700, true}, {2, 3000, false}};
+
+// The sequence, position and strand of the alignment variants that are inserted, which score differently.
+std::vector<std::tuple<size_t, size_t, bool>> const variant_insertions{{0, 1500, false}, {0, 3500, true},
+                                                                       {1, 300, false}, {1, 2200, true},
+                                                                       {1, 3300, false}, {2, 1900, false},
+                                                                       {2, 2600, true}};
+
+// Append a single character to the query of a search, which extends only the requested character.
+bool append_loop(mars::BiDirectionalSearch & bds, std::pair<float, seqan3::rna4> item, bool left)
+{
+    bds.compute_loop_children(1u << item.second.to_rank(), left);
+    return bds.append_child(item, left);
+}
+
+// Compute the base pair partner of each position in the structure, or -1 if unpaired.
+std::vector<int> base_pairs()
+{
+    std::vector<int> bpseq(structure.size(), -1);
+    std::vector<int> stack{};
+    for (size_t idx = 0; idx < structure.size(); ++idx)
+    {
+        if (structure[idx] == '(')
+        {
+            stack.push_back(idx);
+        }
+        else if (structure[idx] == ')')
+        {
+            bpseq[idx] = stack.back();
+            bpseq[stack.back()] = idx;
+            stack.pop_back();
+        }
+    }
+    return bpseq;
+}
+
+// The complementary nucleotide, where U is written as T.
+char complement(char nt)
+{
+    return nt == 'A' ? 'T' : nt == 'C' ? 'G' : nt == 'G' ? 'C' : 'A';
+}
+
+// The reverse complement of a DNA sequence.
+std::string reverse_complement(std::string const & seq)
+{
+    std::string result(seq.rbegin(), seq.rend());
+    std::transform(result.begin(), result.end(), result.begin(), complement);
+    return result;
+}
+
+// The fixture generates a random genome with inserted motifs, the reverse complement of the genome and the motifs.
+class Search : public ::testing::Test
+{
+protected:
+    std::filesystem::path test_dir{};
+    std::filesystem::path genome_file{};
+    std::filesystem::path reverse_file{};
+    std::vector<mars::StemloopMotif> motifs{};
+
+    void SetUp() override
+    {
+        test_dir = std::string{OUTPUTDIR} + "Search";
+        std::filesystem::create_directories(test_dir);
+        genome_file = test_dir / "genome.fa";
+        reverse_file = test_dir / "genome_rc.fa";
+        std::filesystem::remove(test_dir / "genome.fa.marsindex");
+        std::filesystem::remove(test_dir / "genome_rc.fa.marsindex");
+
+        // a sequence that folds into the structure
+        std::mt19937 rng{42};
+        std::vector<int> const bpseq = base_pairs();
+        std::string motif_seq(structure.size(), 'A');
+        for (size_t idx = 0; idx < structure.size(); ++idx)
+            motif_seq[idx] = bpseq[idx] < static_cast<int>(idx) ? "ACGT"[rng() % 4] : complement(motif_seq[bpseq[idx]]);
+
+        // the alignment consists of variants that keep the base pairs
+        mars::Msa msa{};
+        std::vector<std::string> variants{};
+        for (int num = 0; num < 8; ++num)
+        {
+            std::string variant = motif_seq;
+            for (size_t idx = 0; idx < variant.size(); ++idx)
+            {
+                if (rng() % 8 == 0)
+                {
+                    variant[idx] = "ACGT"[rng() % 4];
+                    if (bpseq[idx] >= 0)
+                        variant[bpseq[idx]] = complement(variant[idx]);
+                }
+            }
+            msa.sequences.emplace_back();
+            for (char nt : variant)
+                msa.sequences.back().push_back(seqan3::rna15{}.assign_char(nt));
+            msa.names.push_back("variant" + std::to_string(num));
+            variants.push_back(variant);
+        }
+        std::vector<int> plevel(bpseq.size());
+        std::transform(bpseq.begin(), bpseq.end(), plevel.begin(), [] (int bp) { return bp < 0 ? -1 : 0; });
+        motifs = mars::detect_stemloops(bpseq, plevel);
+        for (mars::StemloopMotif & motif : motifs)
+            motif.analyze(msa, bpseq);
+
+        // random sequences with the motif inserted on either strand
+        std::vector<std::string> genome(3);
+        for (std::string & seq : genome)
+            for (size_t idx = 0; idx < sequence_length; ++idx)
+                seq.push_back("ACGT"[rng() % 4]);
+        for (auto const & [seq, pos, reverse] : insertions)
+            genome[seq].replace(pos, motif_seq.size(), reverse ? reverse_complement(motif_seq) : motif_seq);
+        for (size_t num = 0; num < variant_insertions.size(); ++num)
+        {
+            auto const & [seq, pos, reverse] = variant_insertions[num];
+            std::string const & variant = variants[num % variants.size()];
+            genome[seq].replace(pos, variant.size(), reverse ? reverse_complement(variant) : variant);
+        }
+
+        std::ofstream ofs{genome_file};
+        std::ofstream rev_ofs{reverse_file};
+        for (size_t seq = 0; seq < genome.size(); ++seq)
+        {
+            ofs << ">seq" << seq << "\n" << genome[seq] << "\n";
+            rev_ofs << ">seq" << seq << "\n" << reverse_complement(genome[seq]) << "\n";
+        }
+    }
+
+    void TearDown() override
+    {
+        std::filesystem::remove_all(test_dir);
+    }
+
+    // Search the motifs and return the locations.
+    std::vector<mars::MotifLocation> search(std::filesystem::path const & genome,
+                                            unsigned int threads,
+                                            float min_score = std::numeric_limits<float>::lowest(),
+                                            size_t max_hits = 0,
+                                            bool both_strands = true,
+                                            unsigned int split_depth = 2) const
+    {
+        mars::BiDirectionalIndex index{};
+        index.create(genome);
+        mars::SearchGenerator generator{index, motifs.front().depth, 4, threads, split_depth, min_score, max_hits,
+                                        std::numeric_limits<float>::lowest(), both_strands};
+        generator.find_motifs(motifs);
+        return generator.get_locations();
+    }
+};
+
+// Check whether a location is near an insertion.
+bool at_insertion(mars::MotifLocation const & loc, size_t seq, size_t pos, bool reverse)
+{
+    return loc.sequence == seq && loc.reverse == reverse &&
+           loc.position + 10 >= static_cast<long long>(pos) &&
+           loc.position <= static_cast<long long>(pos + structure.size());
+}
+
+TEST_F(Search, InsertedMotifs)
+{
+    ASSERT_EQ(motifs.size(), 3ul);
+    std::vector<mars::MotifLocation> const locations = search(genome_file, 1);
+    EXPECT_TRUE(std::is_sorted(locations.begin(), locations.end(), mars::MotifLocationCompare{}));
+
+    // every insertion is found on its strand
+    for (auto const & [seq, pos, reverse] : insertions)
+    {
+        EXPECT_TRUE(std::ranges::any_of(locations, [seq = seq, pos = pos, reverse = reverse] (auto const & loc)
+        {
+            return at_insertion(loc, seq, pos, reverse) && loc.num_stemloops == 3u;
+        })) << "insertion in sequence " << seq << " at " << pos;
+    }
+
+    // the forward search does not report the reverse strand
+    std::vector<mars::MotifLocation> const forward = search(genome_file, 1, std::numeric_limits<float>::lowest(),
+                                                            0, false);
+    EXPECT_TRUE(std::ranges::none_of(forward, [] (auto const & loc) { return loc.reverse; }));
+    EXPECT_EQ(static_cast<ptrdiff_t>(forward.size()),
+              std::ranges::count_if(locations, [] (auto const & loc) { return !loc.reverse; }));
+}
+
+TEST_F(Search, CompiledProgram)
+{
+    mars::BiDirectionalIndex index{};
+    index.create(genome_file);
+    mars::SearchGenerator const generator{index, motifs.front().depth};
+    for (mars::StemloopMotif const & motif : motifs)
+    {
+        mars::SearchProgram const program = generator.compile(motif);
+        EXPECT_EQ(program.motif, &motif);
+        EXPECT_FALSE(program.reverse);
+
+        // There is one step per profile column and a final report step.
+        size_t columns = 0;
+        for (auto const & element : motif.elements)
+            std::visit([&columns] (auto const & elem) { columns += elem.profile.size(); }, element);
+        ASSERT_EQ(program.steps.size(), columns + 1);
+        EXPECT_EQ(program.steps.back().kind, mars::StepKind::report);
+        EXPECT_EQ(program.loop_candidates.size() + program.stem_candidates.size(), columns);
+
+        // The steps start at the hairpin, which is the innermost element.
+        auto const & hairpin = motif.elements.back();
+        ASSERT_TRUE(std::holds_alternative<mars::LoopElement>(hairpin));
+        mars::StepKind const hairpin_kind = std::get<mars::LoopElement>(hairpin).is_5prime ? mars::StepKind::loop_left
+                                                                                           : mars::StepKind::loop_right;
+        EXPECT_EQ(program.steps.front().kind, hairpin_kind);
+
+        // Each step refers to its own candidate list, and the gaps jump forward to marked steps.
+        for (uint32_t idx = 0; idx + 1 < program.steps.size(); ++idx)
+        {
+            mars::SearchStep const & step = program.steps[idx];
+            EXPECT_NE(step.kind, mars::StepKind::report);
+            if (step.kind == mars::StepKind::stem)
+                EXPECT_LT(step.candidates, program.stem_candidates.size());
+            else
+                EXPECT_LT(step.candidates, program.loop_candidates.size());
+
+            ASSERT_LE(step.gaps_begin, step.gaps_end);
+            ASSERT_LE(step.gaps_end, program.gap_targets.size());
+            for (uint32_t gap = step.gaps_begin; gap < step.gaps_end; ++gap)
+            {
+                EXPECT_GT(program.gap_targets[gap], idx);
+                ASSERT_LT(program.gap_targets[gap], program.steps.size());
+                EXPECT_TRUE(program.steps[program.gap_targets[gap]].gap_target);
+            }
+        }
+    }
+}
+
+// Check that two lists of locations are equal.
+void expect_same_locations(std::vector<mars::MotifLocation> const & expected,
+                           std::vector<mars::MotifLocation> const & actual)
+{
+    ASSERT_EQ(actual.size(), expected.size());
+    for (size_t idx = 0; idx < expected.size(); ++idx)
+    {
+        EXPECT_EQ(actual[idx].sequence, expected[idx].sequence);
+        EXPECT_EQ(actual[idx].position, expected[idx].position);
+        EXPECT_EQ(actual[idx].reverse, expected[idx].reverse);
+        EXPECT_EQ(actual[idx].num_stemloops, expected[idx].num_stemloops);
+        EXPECT_EQ(actual[idx].score, expected[idx].score);
+    }
+}
+
+TEST_F(Search, Concurrency)
+{
+    // The motifs are searched concurrently with one search state per thread, which does not change the results.
+    std::vector<mars::MotifLocation> const single = search(genome_file, 1);
+    ASSERT_FALSE(single.empty());
+    expect_same_locations(single, search(genome_file, 4, std::numeric_limits<float>::lowest(), 0, true, 0));
+
+    // The shards of an index are searched concurrently as well.
+    std::filesystem::remove(test_dir / "genome.fa.marsindex");
+    mars::IndexOptions options{};
+    options.shards = 3;
+    mars::BiDirectionalIndex index{};
+    index.create(genome_file, options);
+    ASSERT_EQ(index.number_of_shards(), 3ul);
+    mars::SearchGenerator generator{index, motifs.front().depth, 4, 4, 0, std::numeric_limits<float>::lowest(), 0,
+                                    std::numeric_limits<float>::lowest(), true};
+    generator.find_motifs(motifs);
+    expect_same_locations(single, generator.get_locations());
+}
+
+TEST_F(Search, SplitDepth)
+{
+    // The subtrees of a motif become tasks up to the split depth, which does not change the results.
+    std::vector<mars::MotifLocation> const unsplit = search(genome_file, 4, std::numeric_limits<float>::lowest(), 0,
+                                                            true, 0);
+    ASSERT_FALSE(unsplit.empty());
+    for (unsigned int split_depth : {1u, 3u, 6u})
+        expect_same_locations(unsplit, search(genome_file, 4, std::numeric_limits<float>::lowest(), 0, true,
+                                              split_depth));
+}
+
+TEST_F(Search, CandidateTables)
+{
+    mars::BiDirectionalIndex index{};
+    index.create(genome_file);
+    mars::SearchGenerator const generator{index, motifs.front().depth};
+
+    // The candidates of a column are distinct characters, filtered by their score and sorted by decreasing score.
+    auto check = [] (auto const & list)
+    {
+        EXPECT_LE(list.size, list.items.size());
+        EXPECT_TRUE(std::is_sorted(list.begin(), list.end(), std::greater<>{}));
+        std::vector<size_t> ranks{};
+        for (auto const & [score, character] : list)
+        {
+            EXPECT_GE(score, -2.f);
+            ranks.push_back(seqan3::to_rank(character));
+        }
+        std::sort(ranks.begin(), ranks.end());
+        EXPECT_EQ(std::adjacent_find(ranks.begin(), ranks.end()), ranks.end());
+    };
+
+    for (mars::StemloopMotif const & motif : motifs)
+    {
+        mars::SearchProgram const program = generator.compile(motif);
+        std::for_each(program.loop_candidates.begin(), program.loop_candidates.end(), check);
+        std::for_each(program.stem_candidates.begin(), program.stem_candidates.end(), check);
+
+        // The base pairs of the alignment are candidates.
+        EXPECT_TRUE(std::ranges::any_of(program.stem_candidates, [] (auto const & list) { return list.size > 0; }));
+    }
+}
+
+TEST_F(Search, MinScorePruning)
+{
+    std::vector<mars::MotifLocation> const unpruned = search(genome_file, 4);
+    ASSERT_FALSE(unpruned.empty());
+
+    // A bound below all stem loop scores keeps everything.
+    EXPECT_EQ(search(genome_file, 4, -1000.f).size(), unpruned.size());
+
+    // Pruning removes the stem loop hits below the bound, such that weaker locations lose stem loops or vanish.
+    std::vector<mars::MotifLocation> const pruned = search(genome_file, 4, 30.f);
+    EXPECT_LT(pruned.size(), unpruned.size());
+    for (mars::MotifLocation const & loc : pruned)
+    {
+        auto const expected = std::ranges::find_if(unpruned, [&loc] (mars::MotifLocation const & other)
+        {
+            return other.sequence == loc.sequence && other.position == loc.position && other.reverse == loc.reverse;
+        });
+        ASSERT_NE(expected, unpruned.end());
+        EXPECT_LE(loc.score, expected->score);
+        EXPECT_LE(loc.num_stemloops, expected->num_stemloops);
+    }
+
+    // The inserted consensus sequences score above the bound and are found unchanged.
+    for (auto const & [seq, pos, reverse] : insertions)
+    {
+        auto const inserted = [seq = seq, pos = pos, reverse = reverse] (mars::MotifLocation const & loc)
+        {
+            return at_insertion(loc, seq, pos, reverse);
+        };
+        auto const expected = std::ranges::find_if(unpruned, inserted);
+        auto const found = std::ranges::find_if(pruned, inserted);
+        ASSERT_NE(expected, unpruned.end());
+        ASSERT_NE(found, pruned.end());
+        EXPECT_EQ(found->position, expected->position);
+        EXPECT_EQ(found->num_stemloops, 3u);
+        EXPECT_FLOAT_EQ(found->score, expected->score);
+    }
+}
+
+TEST_F(Search, TranspositionTable)
+{
+    using seqan3::operator""_rna4;
+
+    mars::BiDirectionalIndex index{};
+    index.create(genome_file);
+    mars::BiDirectionalSearch bds{index.shard(0), 4, 8};
+    mars::TranspositionTable table{4};
+    ASSERT_TRUE(append_loop(bds, {1.f, 'G'_rna4}, true));
+    ASSERT_TRUE(append_loop(bds, {1.f, 'C'_rna4}, true));
+    EXPECT_FALSE(table.dominated(3u, bds));
+    table.insert(3u, bds);
+
+    // The same query with the same scores is dominated at the same step, but not at another one.
+    mars::BiDirectionalSearch same{index.shard(0), 4, 8};
+    ASSERT_TRUE(append_loop(same, {1.f, 'G'_rna4}, true));
+    ASSERT_TRUE(append_loop(same, {1.f, 'C'_rna4}, true));
+    EXPECT_TRUE(table.dominated(3u, same));
+    EXPECT_FALSE(table.dominated(4u, same));
+
+    // A lower score is dominated, a higher score is not.
+    mars::BiDirectionalSearch lower{index.shard(0), 4, 8};
+    ASSERT_TRUE(append_loop(lower, {0.5f, 'G'_rna4}, true));
+    ASSERT_TRUE(append_loop(lower, {1.f, 'C'_rna4}, true));
+    EXPECT_TRUE(table.dominated(3u, lower));
+    mars::BiDirectionalSearch higher{index.shard(0), 4, 8};
+    ASSERT_TRUE(append_loop(higher, {2.f, 'G'_rna4}, true));
+    ASSERT_TRUE(append_loop(higher, {1.f, 'C'_rna4}, true));
+    EXPECT_FALSE(table.dominated(3u, higher));
+
+    // Another query is not dominated.
+    mars::BiDirectionalSearch other{index.shard(0), 4, 8};
+    ASSERT_TRUE(append_loop(other, {1.f, 'G'_rna4}, true));
+    ASSERT_TRUE(append_loop(other, {1.f, 'G'_rna4}, true));
+    EXPECT_FALSE(table.dominated(3u, other));
+}
+
+TEST_F(Search, Clustering)
+{
+    // The sequences are clustered in parallel, which gives the same locations in the same order.
+    std::vector<mars::MotifLocation> const locations = search(genome_file, 3);
+    ASSERT_FALSE(locations.empty());
+    expect_same_locations(search(genome_file, 1), locations);
+
+    // Each location combines at least two stem loops of a window, and a window is reported at most once.
+    for (mars::MotifLocation const & loc : locations)
+    {
+        EXPECT_GT(loc.num_stemloops, 1u);
+        EXPECT_LE(loc.num_stemloops, motifs.size());
+    }
+    std::vector<std::tuple<size_t, bool, long long>> windows{};
+    for (mars::MotifLocation const & loc : locations)
+        windows.emplace_back(loc.sequence, loc.reverse, loc.position);
+    std::sort(windows.begin(), windows.end());
+    EXPECT_EQ(std::adjacent_find(windows.begin(), windows.end()), windows.end());
+}
+
+TEST_F(Search, BestHits)
+{
+    // The bounded heap keeps exactly the best locations of the full list.
+    std::vector<mars::MotifLocation> const all = search(genome_file, 4);
+    ASSERT_GT(all.size(), 7ul);
+    std::vector<mars::MotifLocation> const best = search(genome_file, 4, std::numeric_limits<float>::lowest(), 7);
+    ASSERT_EQ(best.size(), 7ul);
+    for (size_t idx = 0; idx < best.size(); ++idx)
+    {
+        EXPECT_EQ(best[idx].sequence, all[idx].sequence);
+        EXPECT_EQ(best[idx].position, all[idx].position);
+        EXPECT_EQ(best[idx].reverse, all[idx].reverse);
+        EXPECT_EQ(best[idx].score, all[idx].score);
+    }
+}
+
+TEST_F(Search, StreamedOrder)
+{
+    mars::BiDirectionalIndex index{};
+    index.create(genome_file);
+    mars::SearchGenerator full{index, motifs.front().depth, 4, 4, 2, std::numeric_limits<float>::lowest(), 0,
+                               std::numeric_limits<float>::lowest(), true};
+    full.find_motifs(motifs);
+
+    // The locations are reported per sequence and strand, in the order of the sequences with the forward strand first.
+    mars::SearchGenerator streamed{index, motifs.front().depth, 4, 4, 2, std::numeric_limits<float>::lowest(), 0,
+                                   std::numeric_limits<float>::lowest(), true};
+    std::vector<mars::MotifLocation> reported{};
+    std::vector<std::pair<size_t, bool>> batches{};
+    streamed.find_motifs(motifs, [&reported, &batches] (std::vector<mars::MotifLocation> const & locations)
+    {
+        ASSERT_FALSE(locations.empty());
+        EXPECT_TRUE(std::is_sorted(locations.begin(), locations.end(), mars::MotifLocationCompare{}));
+        for (mars::MotifLocation const & loc : locations)
+        {
+            EXPECT_EQ(loc.sequence, locations.front().sequence);
+            EXPECT_EQ(loc.reverse, locations.front().reverse);
+        }
+        batches.emplace_back(locations.front().sequence, locations.front().reverse);
+        reported.insert(reported.end(), locations.begin(), locations.end());
+    });
+    EXPECT_TRUE(streamed.get_locations().empty());
+    EXPECT_TRUE(std::is_sorted(batches.begin(), batches.end()));
+    EXPECT_EQ(std::adjacent_find(batches.begin(), batches.end()), batches.end());
+
+    // the same locations as without streaming
+    std::sort(reported.begin(), reported.end(), mars::MotifLocationCompare{});
+    ASSERT_EQ(reported.size(), full.get_locations().size());
+    for (size_t idx = 0; idx < reported.size(); ++idx)
+    {
+        EXPECT_EQ(reported[idx].sequence, full.get_locations()[idx].sequence);
+        EXPECT_EQ(reported[idx].position, full.get_locations()[idx].position);
+        EXPECT_EQ(reported[idx].reverse, full.get_locations()[idx].reverse);
+    }
+}
+
+TEST_F(Search, ReverseComplement)
+{
+    // The reverse strand of the genome is the forward strand of the reverse complemented genome.
+    std::vector<mars::MotifLocation> const locations = search(genome_file, 4);
+    std::vector<mars::MotifLocation> const mirrored = search(reverse_file, 4, std::numeric_limits<float>::lowest(),
+                                                             0, false);
+    auto const key = [] (mars::MotifLocation const & loc)
+    {
+        return std::make_tuple(loc.sequence, loc.position, loc.num_stemloops, loc.score);
+    };
+
+    std::vector<std::tuple<size_t, long long, uint8_t, float>> reverse_keys{};
+    for (mars::MotifLocation const & loc : locations)
+        if (loc.reverse)
+            reverse_keys.push_back(key(loc));
+    std::vector<std::tuple<size_t, long long, uint8_t, float>> mirrored_keys{};
+    for (mars::MotifLocation loc : mirrored)
+    {
+        loc.position = static_cast<long long>(sequence_length) - 1 - loc.position;
+        mirrored_keys.push_back(key(loc));
+    }
+    std::sort(reverse_keys.begin(), reverse_keys.end());
+    std::sort(mirrored_keys.begin(), mirrored_keys.end());
+    EXPECT_FALSE(reverse_keys.empty());
+    EXPECT_EQ(reverse_keys, mirrored_keys);
+}